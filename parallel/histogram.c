@@ -1,127 +1,516 @@
 /* File:      histogram.c
  * A program that generates a bunch of random data and stores them in different bins.
  * It then displays the data as a histogram
- * The methods that I wrote are main, thread_func, and barrier.
+ * The methods that I wrote are main and thread_func.
  * The rest was provided by the instructor.
+ *
+ * Compile:  gcc -O2 -pthread histogram.c -o histogram -lm
+ *           mpicc -O2 -pthread -DUSE_MPI histogram.c -o histogram -lm
+ *           gcc -O2 -pthread -DHISTOGRAM_LIB -c histogram.c  (the histogram.h API)
+ * Usage:    ./histogram [-M tree|mutex|atomic] <thread_count> <bins[@min:max],...>
+ *              <min_meas> <max_meas> <data_count|data_file>[,...]
+ *              [auto|search|scalar|sse2|avx2 [uniform|normal|exponential [seed]]]
+ *   bins       bin_count, log:bin_count, hdr:digits[:out.hdr] or a file of
+ *              edges, a list of them makes a grid
+ *   data       points to generate, a float32 file (.f64 for float64), or
+ *              with hdr: bins an .hdr snapshot to add in
+ *   -M         how the threads' counts are added up, tree by default
  */
  
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "histogram.h"
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#define CHUNK_BYTES (16*1024*1024) /* read from a data file at once */
+#define CACHE_LINE 64
+#define FLAG_STRIDE (CACHE_LINE/sizeof(atomic_int)) /* one flag per line */
+
+/* past this many bins the per-lane histograms stop fitting in cache */
+#define MAX_LANE_BINS 16384
+
+/* ways of finding a point's bin */
+#define SEARCH 0
+#define SCALAR 1
+#define SSE2 2
+#define AVX2 3
+#define ND 4 /* grids, each axis its own way */
+
+/* how the bin edges are spaced */
+#define LINEAR 0
+#define LOG 1
+#define EDGES_FILE 2
+#define HDR 3
+#define GRID 4
+
+#define HDR_MAGIC "HDRH"
+#define HDR_VERSION 1
+
+/* points searched for together, so their cache misses overlap */
+#define SEARCH_LANES 8
+/* tree levels between a node and the cache line of its descendants
+   prefetched with it, 2^4 floats are a cache line */
+#define PREFETCH_LEVELS 4
 
-int* bin_counts;
-pthread_mutex_t* locks; //locks for each bin
+/* ways of putting the threads' counts together */
+#define TREE_MERGE 0
+#define MUTEX_MERGE 1
+#define ATOMIC_MERGE 2
+
+/* widest bar Print_histo prints */
+#define PRINT_WIDTH 60
+
+/* a live histogram's slice that is being cleared for reuse */
+#define CLEARING (-1LL)
+#define FLAG_LLONGS (CACHE_LINE/sizeof(atomic_llong))
+
+/* points a grid finds the cells of together */
+#define GRID_BLOCK 256
+/* grids of more than this many bytes of counts are kept sparse */
+#define SPARSE_BYTES (1 << 20)
+#define EMPTY_CELL UINT64_MAX
+/* bins past this are added up across processes a piece at a time, with
+   several pieces' reductions in flight at once */
+#define MPI_SEGMENT (1 << 20)
+
+#ifdef HAVE_X86_SIMD
+/* also build an avx2 copy of loops the compiler vectorizes, picked at
+   load time if the cpu has it */
+#define VECTOR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_CLONES
+#endif
+
+/* shapes of generated data */
+#define UNIFORM 0
+#define NORMAL 1
+#define EXPONENTIAL 2
+
+long long* bin_counts;
 float min_meas, max_meas;
 float* bin_maxes;
-int data_count, bin_count, thread_count;
+float lowest_edge; /* bottom of the first bin */
+int bin_layout;
+float* tree; /* bin_maxes[0..bin_count-2] in breadth first order from tree[1] */
+int tree_height;
+/* with bin_layout HDR a point's bin is (float bits >> hdr_shift) - hdr_base */
+int hdr_digits, hdr_shift;
+uint32_t hdr_base;
+char* hdr_out; /* file to save the total in, can be NULL */
+long long* hdr_total; /* counts over every data set */
+/* a grid's axis, the bins Setup_bins made for it */
+typedef struct {
+   int layout, count, tree_height, hdr_shift;
+   uint32_t hdr_base;
+   float min, lowest_edge, width, inv_width;
+   float *maxes, *tree;
+} axis;
+/* the cells of a sparse grid that have points, open addressing */
+typedef struct {
+   _Alignas(CACHE_LINE) uint64_t* keys; /* EMPTY_CELL if unused */
+   long long* counts;
+   size_t size, used;
+} cell_table;
+int dims = 1; /* floats per point */
+axis* axes;
+long long cells;
+int sparse; /* cells are counted in tables instead of bins */
+cell_table* tables; /* one per thread */
+int chunk_bytes; /* CHUNK_BYTES cut to whole points */
+/* live histograms */
+struct live_histo {
+   int slices, shards;
+   long long slice_ns;
+   size_t head; /* counters before a shard's first row of counts */
+   atomic_llong dropped;
+   /* for each shard, which slice each slot holds then the slots' counts */
+   _Atomic(atomic_llong*)* shard;
+   atomic_int* owned; /* 1 while a thread records into the shard */
+   pthread_key_t key; /* a thread's &owned[its shard] */
+};
+long long data_count; /* points generated by this process */
+int bin_count, thread_count;
 float* data;
 pthread_t* thread_handles;
-/* barrier variables */
-int barrier_counter = 0;
-pthread_mutex_t barrier_lock;
-pthread_cond_t barrier_cond;
+float bin_width, inv_width;
+int bin_method;
+const char* method_names[] = {"search", "scalar", "sse2", "avx2", "grid"};
+int distribution;
+const char* distribution_names[] = {"uniform", "normal", "exponential"};
+uint64_t seed;
+double gen_time, bin_time, merge_time; /* seconds the slowest thread spent on each */
+pthread_mutex_t time_lock;
+/* data file, data_fd is -1 when the data is generated */
+int data_fd = -1, elem_size;
+long long file_points;
+off_t next_offset; /* start of the next chunk nobody has taken */
+off_t data_end; /* end of this process' part of the file */
+long long data_offset; /* number of the first value this process generates */
+int mpi_rank = 0, mpi_size = 1;
+pthread_mutex_t chunk_lock;
+/* thread pool, workers run a data set each time job goes up */
+int job = 0, jobs_done = 0, quit = 0;
+pthread_mutex_t pool_lock;
+pthread_cond_t job_cond, done_cond;
+long long** loc_counts; /* each thread's bins, cache line aligned */
+atomic_int* merged; /* last job each thread's subtree was added up for */
+int merge_method;
+const char* merge_names[] = {"tree", "mutex", "atomic"};
+pthread_mutex_t* locks; /* for each of bin_counts with MUTEX_MERGE */
+atomic_llong* shared_counts; /* with ATOMIC_MERGE */
+atomic_int finished; /* threads done with the job, for the shared merges */
    
 void Usage(char prog_name[]);
 
 void Get_args(
       char*    argv[]        /* in  */,
-      int*     bin_count_p   /* out */,
+      char**   bin_spec_p    /* out */,
       float*   min_meas_p    /* out */,
       float*   max_meas_p    /* out */,
-      int*     data_count_p  /* out */,
-	  int*     thread_count_p);
+	  int*     thread_count_p,
+      char**   datasets_p    /* out */);
+
+void Get_bins(char* bin_spec);
+
+void Read_edges(char* path);
+
+void Build_tree(void);
+
+int Tree_bin(float x);
+
+long long Now_ns(void);
+
+atomic_llong* Live_shard(live_histo* h);
+
+void Live_release(void* owned);
+
+void Hdr_bins(char* spec);
+
+void Grid_bins(char* spec);
+
+void Axis_index(const axis* a, const float x[], int n, uint64_t idx[]);
+
+void Count_grid(float points[], int n, int chunk_counts[], cell_table* table);
+
+void Table_add(cell_table* table, uint64_t cell, long long n);
+
+void Table_clear(cell_table* table);
+
+void Print_grid(long long counts[], cell_table* table);
+
+void Print_cell(uint64_t cell, long long count);
+
+int Compare_cells(const void* a, const void* b);
+
+void Shard(long long n, long long* first_p, long long* count_p);
+
+#ifdef USE_MPI
+long long Mpi_reduce(long long counts[], cell_table* table, long long points);
+#endif
+
+int Hdr_bin(float x);
+
+void Bin_hdr(float data[], long long first, long long last, int loc_bin_counts[]);
+
+float Quantile(long long counts[], long long total, double q);
+
+void Print_quantiles(char* name, long long counts[], long long total);
+
+void Write_snapshot(char* path, long long counts[]);
+
+long long Read_snapshot(char* path, long long counts[]);
+
+void Put_varint(FILE* f, int64_t v);
+
+int Get_varint(FILE* f, int64_t* v_p);
+
+long long Set_dataset(char* dataset);
+
+void Run_job(void);
+
+void Open_data(char* path);
+
+int Read_chunk(float chunk[]);
+
+void Count_chunk(float points[], int n, int chunk_counts[], long long loc_bin_counts[],
+      cell_table* table);
 
 void Gen_data(
       float   min_meas    /* in  */, 
       float   max_meas    /* in  */, 
       float   data[]      /* out */,
-      int     data_count  /* in  */);
+      long long first     /* in  */,
+      long long last      /* in  */);
+
+uint64_t Hash(uint64_t i);
 
 void Gen_bins(
       float min_meas      /* in  */, 
       float max_meas      /* in  */, 
       float bin_maxes[]   /* out */, 
-      int   bin_counts[]  /* out */, 
+      long long bin_counts[]  /* out */, 
       int   bin_count     /* in  */);
 
-int Which_bin(
-      float    data         /* in */, 
-      float    bin_maxes[]  /* in */, 
-      int      bin_count    /* in */, 
-      float    min_meas     /* in */);
-
 void Print_histo(
       float    bin_maxes[]   /* in */, 
-      int      bin_counts[]  /* in */, 
+      long long bin_counts[] /* in */, 
       int      bin_count     /* in */, 
       float    min_meas      /* in */);
 	  
+void Bin_search(
+      float    data[]          /* in  */,
+      long long first          /* in  */,
+      long long last           /* in  */,
+      int      loc_bin_counts[] /* out */);
+
+void Bin_uniform(
+      float    data[]          /* in  */,
+      long long first          /* in  */,
+      long long last           /* in  */,
+      int      loc_bin_counts[] /* out */);
+
+int Uniform_bin(float x);
+
+#ifdef HAVE_X86_SIMD
+void Bin_sse2(float data[], long long first, long long last, int lane_counts[], int stride);
+
+void Bin_avx2(float data[], long long first, long long last, int lane_counts[], int stride);
+#endif
+
+int Pick_method(const char* name);
+
+int Pick_distribution(const char* name);
+
+void Slice(long my_rank, long long* first_p, long long* last_p);
+
+void Record_time(double* slowest_p, double elapsed);
+
+double Now(void);
+
 void *Thread_func(void *rank);
 
-void Barrier();
+void Count_dataset(long my_rank, long long loc_bin_counts[], int chunk_counts[]);
+
+void Reduce(long my_rank, int my_job);
+
+void Merge_locked(long long loc_bin_counts[]);
+
+int Pick_merge(const char* name);
 
+#ifndef HISTOGRAM_LIB
 int main(int argc, char* argv[]) {
    long i;
-   
-   /* Check and get command line args */
-   if (argc != 6) Usage(argv[0]); 
-   Get_args(argv, &bin_count, &min_meas, &max_meas, &data_count, &thread_count);
+   long long points;
+   int sets = 0;
+   char *bin_spec, *datasets, *dataset, *save;
+   int opt;
+#  ifdef USE_MPI
+   int provided;
+   double start, reduce_time, times[4];
 
-   /* Allocate arrays needed */
-   bin_maxes = malloc(bin_count*sizeof(float));
-   bin_counts = malloc(bin_count*sizeof(int));
-   data = malloc(data_count*sizeof(float));
-   locks = malloc(bin_count*sizeof(pthread_mutex_t));
-   thread_handles = malloc (thread_count*sizeof(pthread_t));
-   
-   printf("Generating Data...\n");
-   /* Generate the data, not generated in parallel */
-   Gen_data(min_meas, max_meas, data, data_count);
-   printf("Data Generated!\n");
+   /* only this thread calls MPI */
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+   MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+   MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+#  endif
    
+   /* Check and get command line args, + stops at the first argument
+      that isn't an option so a negative min_meas isn't taken for one */
+   while ((opt = getopt(argc, argv, "+M:")) != -1) {
+      if (opt != 'M')
+         Usage(argv[0]);
+      merge_method = Pick_merge(optarg);
+   }
+   argv[optind - 1] = argv[0];
+   argv += optind - 1;
+   argc -= optind - 1;
+   if (argc < 6 || argc > 9) Usage(argv[0]); 
+   Get_args(argv, &bin_spec, &min_meas, &max_meas, &thread_count, &datasets);
    /* Create bins for storing counts */
-   Gen_bins(min_meas, max_meas, bin_maxes, bin_counts, bin_count);
+   Setup_bins(bin_spec, min_meas, max_meas);
+   if (merge_method != TREE_MERGE && bin_layout == GRID) {
+      fprintf(stderr, "Grids are only merged with -M tree\n");
+      exit(0);
+   }
+   bin_method = Pick_method((argc > 6) ? argv[6] : "auto");
+   distribution = Pick_distribution((argc > 7) ? argv[7] : "uniform");
+   seed = (argc > 8) ? strtoull(argv[8], NULL, 10) : 0;
 
-   /* initialize locks */
-   for (i=0; i<bin_count; i++) {
-      pthread_mutex_init(&locks[i], NULL);
+   /* Allocate arrays needed */
+   bin_counts = malloc(bin_count*sizeof(long long));
+   thread_handles = malloc (thread_count*sizeof(pthread_t));
+   loc_counts = malloc(thread_count*sizeof(long long*));
+   tables = aligned_alloc(CACHE_LINE, thread_count*sizeof(cell_table));
+   memset(tables, 0, thread_count*sizeof(cell_table));
+   merged = aligned_alloc(CACHE_LINE, thread_count*FLAG_STRIDE*sizeof(atomic_int));
+   for (i = 0; i < thread_count; i++)
+      atomic_init(&merged[i*FLAG_STRIDE], 0);
+   if (merge_method == MUTEX_MERGE) {
+      locks = malloc(bin_count*sizeof(pthread_mutex_t));
+      for (i = 0; i < bin_count; i++)
+         pthread_mutex_init(&locks[i], NULL);
    }
-   pthread_mutex_init(&barrier_lock, NULL);
-   pthread_cond_init(&barrier_cond, NULL);
+   if (merge_method == ATOMIC_MERGE)
+      shared_counts = malloc(bin_count*sizeof(atomic_llong));
+
+   pthread_mutex_init(&time_lock, NULL);
+   pthread_mutex_init(&chunk_lock, NULL);
+   pthread_mutex_init(&pool_lock, NULL);
+   pthread_cond_init(&job_cond, NULL);
+   pthread_cond_init(&done_cond, NULL);
    
-   /* create threads */
+   /* create threads, they wait for the first job */
    for (i = 0; i < thread_count; i++)
       pthread_create(&thread_handles[i], NULL, Thread_func, (void*) i);
 
-	  
-	  
-	/* join threads */
+   if (bin_layout == HDR)
+      hdr_total = calloc(bin_count, sizeof(long long));
+   for (dataset = strtok_r(datasets, ",", &save); dataset != NULL;
+         dataset = strtok_r(NULL, ",", &save)) {
+      sets++;
+      if (bin_layout == HDR && strlen(dataset) > 4
+            && strcmp(dataset + strlen(dataset) - 4, ".hdr") == 0) {
+         /* counts from another run, only process 0 has the totals */
+         if (mpi_rank != 0)
+            continue;
+         points = Read_snapshot(dataset, bin_counts);
+         Print_quantiles(dataset, bin_counts, points);
+         for (i = 0; i < bin_count; i++)
+            hdr_total[i] += bin_counts[i];
+         continue;
+      }
+      points = Set_dataset(dataset);
+      Run_job();
+      /* the tree leaves the total in thread 0's bins, the mutex merge
+         in bin_counts */
+      if (merge_method == TREE_MERGE)
+         memcpy(bin_counts, loc_counts[0], bin_count*sizeof(long long));
+      else if (merge_method == ATOMIC_MERGE)
+         for (i = 0; i < bin_count; i++)
+            bin_counts[i] = atomic_load_explicit(&shared_counts[i], memory_order_relaxed);
+#     ifdef USE_MPI
+      start = Now();
+      points = Mpi_reduce(bin_counts, &tables[0], points);
+      reduce_time = Now() - start;
+      /* the slowest process' time for each step */
+      times[0] = gen_time;
+      times[1] = bin_time;
+      times[2] = merge_time;
+      times[3] = reduce_time;
+      MPI_Reduce(mpi_rank == 0 ? MPI_IN_PLACE : times, times, 4, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+      gen_time = times[0];
+      bin_time = times[1];
+      merge_time = times[2];
+      reduce_time = times[3];
+#     endif
+      if (mpi_rank != 0) {
+         if (data_fd >= 0)
+            close(data_fd);
+         data_fd = -1;
+         free(data);
+         continue;
+      }
+      if (bin_layout == HDR) {
+         Print_quantiles(dataset, bin_counts, points);
+         for (i = 0; i < bin_count; i++)
+            hdr_total[i] += bin_counts[i];
+      }
+      else if (bin_layout == GRID)
+         Print_grid(bin_counts, &tables[0]);
+      else
+         Print_histo(bin_maxes, bin_counts, bin_count, lowest_edge);
+
+      if (data_fd >= 0) {
+         close(data_fd);
+         data_fd = -1;
+         fprintf(stderr, "%s: read %lld points in %.3f seconds\n",
+               method_names[bin_method], points, gen_time);
+      }
+      else {
+         free(data);
+         fprintf(stderr, "%s: generated %lld %s points in %.3f seconds\n",
+               method_names[bin_method], points, distribution_names[distribution], gen_time);
+      }
+      fprintf(stderr, "%s: binned %lld points in %.6f seconds, merged in %.6f seconds (%s)\n",
+            method_names[bin_method], points, bin_time, merge_time, merge_names[merge_method]);
+#     ifdef USE_MPI
+      fprintf(stderr, "%s: added up %d processes' counts in %.3f seconds\n",
+            method_names[bin_method], mpi_size, reduce_time);
+#     endif
+   }
+
+   if (bin_layout == HDR && mpi_rank == 0) {
+      for (points = 0, i = 0; i < bin_count; i++)
+         points += hdr_total[i];
+      if (sets > 1)
+         Print_quantiles("all", hdr_total, points);
+      if (hdr_out != NULL)
+         Write_snapshot(hdr_out, hdr_total);
+   }
+   free(hdr_total);
+
+   /* join threads */
+   pthread_mutex_lock(&pool_lock);
+   quit = 1;
+   pthread_cond_broadcast(&job_cond);
+   pthread_mutex_unlock(&pool_lock);
    for (i = 0; i < thread_count; i++)
       pthread_join(thread_handles[i], NULL);
    
-   /* destroy locks */
-   for (i=0; i<bin_count; i++) {
+   pthread_mutex_destroy(&time_lock);
+   pthread_mutex_destroy(&chunk_lock);
+   pthread_mutex_destroy(&pool_lock);
+   pthread_cond_destroy(&job_cond);
+   pthread_cond_destroy(&done_cond);
+   for (i = 0; i < bin_count && merge_method == MUTEX_MERGE; i++)
       pthread_mutex_destroy(&locks[i]);
-   }
-   pthread_mutex_destroy(&barrier_lock);
-   pthread_cond_destroy(&barrier_cond);
+   free(locks);
+   free(shared_counts);
 
 #  ifdef DEBUG
    printf("bin_counts = ");
    for (i = 0; i < bin_count; i++)
-      printf("%d ", bin_counts[i]);
+      printf("%lld ", bin_counts[i]);
    printf("\n");
 #  endif
 
 
-   free(data);
    free(bin_maxes);
+   free(tree);
+   for (i = 0; i < dims && bin_layout == GRID; i++) {
+      free(axes[i].maxes);
+      free(axes[i].tree);
+   }
+   free(axes);
    free(bin_counts);
-   free(locks);
+   free(loc_counts);
+   free(tables);
+   free(merged);
    free(thread_handles);
+#  ifdef USE_MPI
+   MPI_Finalize();
+#  endif
    return 0;
 
 }  /* main */
+#endif
 
 
 /*---------------------------------------------------------------------
@@ -130,8 +519,12 @@ int main(int argc, char* argv[]) {
  * In arg:    prog_name:  the name of the program from the command line
  */
 void Usage(char prog_name[] /* in */) {
-   fprintf(stderr, "usage: %s ", prog_name); 
-   fprintf(stderr, "<thread_count> <bin_count> <min_meas> <max_meas> <data_count>\n");
+   fprintf(stderr, "usage: %s [-M tree|mutex|atomic] ", prog_name); 
+   fprintf(stderr, "<thread_count> <bins[@min:max],...> <min_meas> <max_meas> <data_count|data_file>[,...] ");
+   fprintf(stderr, "[auto|search|scalar|sse2|avx2 [uniform|normal|exponential [seed]]]\n");
+   fprintf(stderr, "bins is bin_count, log:bin_count, hdr:digits[:out.hdr] or an edges file\n");
+   fprintf(stderr, "with hdr: bins, data sets ending in .hdr are snapshots to add in\n");
+   fprintf(stderr, "more than one bins makes a grid with a float per axis in each point\n");
    exit(0);
 }  /* Usage */
 
@@ -140,61 +533,574 @@ void Usage(char prog_name[] /* in */) {
  * Function:  Get_args
  * Purpose:   Get the command line arguments
  * In arg:    argv:  strings from command line
- * Out args:  bin_count_p:   number of bins
+ * Out args:  bin_spec_p:    number of bins, log:number of bins,
+ *                           hdr:significant digits or a file of bin
+ *                           edges, or a list of those for a grid
  *            min_meas_p:    minimum measurement
  *            max_meas_p:    maximum measurement
- *            data_count_p:  number of measurements
+ *            thread_count_p: number of threads
+ *            datasets_p:    comma separated numbers of measurements to
+ *                           generate or files to read them from
  */
 void Get_args(
       char*    argv[]        /* in  */,
-      int*     bin_count_p   /* out */,
+      char**   bin_spec_p    /* out */,
       float*   min_meas_p    /* out */,
       float*   max_meas_p    /* out */,
-      int*     data_count_p  /* out */,
-	  int*     thread_count_p) {
+	  int*     thread_count_p,
+      char**   datasets_p    /* out */) {
 
-   *bin_count_p = strtol(argv[2], NULL, 10);
+   *bin_spec_p = argv[2];
    *min_meas_p = strtof(argv[3], NULL);
    *max_meas_p = strtof(argv[4], NULL);
-   *data_count_p = strtol(argv[5], NULL, 10);
+   *datasets_p = argv[5];
    *thread_count_p = strtol(argv[1], NULL, 10);
 
 #  ifdef DEBUG
-   printf("bin_count = %d\n", *bin_count_p);
+   printf("bins = %s\n", *bin_spec_p);
    printf("min_meas = %f, max_meas = %f\n", *min_meas_p, *max_meas_p);
-   printf("data_count = %d\n", *data_count_p);
+   printf("datasets = %s\n", *datasets_p);
 #  endif
 }  /* Get_args */
 
 
+/*---------------------------------------------------------------------
+ * Function:  Setup_bins
+ * Purpose:   Set min_meas and max_meas and set up the bins
+ * In args:   bin_spec:  what Get_bins takes
+ *            min, max:  the range of the measurements
+ */
+void Setup_bins(char* bin_spec, float min, float max) {
+   min_meas = min;
+   max_meas = max;
+   Get_bins(bin_spec);
+   /* same expression as Gen_bins so the edges come out the same */
+   bin_width = (max_meas - min_meas)/bin_count;
+   inv_width = bin_count/(max_meas - min_meas);
+}  /* Setup_bins */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Find_bin
+ * Purpose:   Find the bin of one measurement with the quickest way
+ *            the bins allow
+ * In arg:    x:  the measurement
+ * Return:    the bin, the first or last one for points outside them
+ */
+int Find_bin(float x) {
+   if (bin_layout == HDR)
+      return Hdr_bin(x);
+   if (bin_layout == LINEAR)
+      return Uniform_bin(x);
+   return Tree_bin(x);
+}  /* Find_bin */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Get_bins
+ * Purpose:   Set up bin_maxes, lowest_edge and the search tree
+ * In arg:    bin_spec:  a number of equal width bins, log: and a number
+ *                       of bins from min_meas to max_meas each wider
+ *                       than the last by the same ratio, hdr: and
+ *                       the significant digits to keep, a file of
+ *                       bin edges, or a comma separated list of those
+ *                       for the axes of a grid
+ */
+void Get_bins(char* bin_spec) {
+   char* end;
+
+   bin_layout = LINEAR;
+   if (strchr(bin_spec, ',') != NULL) {
+      Grid_bins(bin_spec);
+      return;
+   }
+   if (strncmp(bin_spec, "hdr:", 4) == 0) {
+      bin_layout = HDR;
+      Hdr_bins(bin_spec + 4);
+      Build_tree();
+      return;
+   }
+   if (strncmp(bin_spec, "log:", 4) == 0) {
+      bin_layout = LOG;
+      bin_spec += 4;
+   }
+   bin_count = strtol(bin_spec, &end, 10);
+   if (end == bin_spec || *end != '\0') {
+      if (bin_layout == LOG)
+         Usage("histogram");
+      bin_layout = EDGES_FILE;
+      Read_edges(bin_spec);
+   }
+   else {
+      if (bin_count < 1) {
+         fprintf(stderr, "Need at least one bin\n");
+         exit(0);
+      }
+      if (bin_layout == LOG && !(min_meas > 0 && max_meas > min_meas)) {
+         fprintf(stderr, "log bins need 0 < min_meas < max_meas\n");
+         exit(0);
+      }
+      bin_maxes = malloc(bin_count*sizeof(float));
+      lowest_edge = min_meas;
+      Gen_bins(min_meas, max_meas, bin_maxes, NULL, bin_count);
+   }
+   Build_tree();
+}  /* Get_bins */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Hdr_bins
+ * Purpose:   Set up log-linear bins from min_meas to max_meas
+ * In arg:    spec:  the significant digits, 1 to 5, optionally
+ *                   followed by : and a file to save the counts in
+ * Notes:
+ * 1.  Keeping d digits takes m = ceil(d log2 10) mantissa bits, so
+ *     every power of two is cut into 2^m bins. The float's exponent
+ *     and its top m mantissa bits are then the bin, and a bin is less
+ *     than 2^-m of its lower edge wide. The middle of a bin is within
+ *     2^-(m+1), under half a unit in the d-th digit, of every point in it
+ * 2.  The first bin starts at or just below min_meas and the last one
+ *     holds max_meas. Points below or above those go in them
+ */
+void Hdr_bins(char* spec) {
+   char* end;
+   uint32_t bits;
+   float edge;
+   int i;
+
+   hdr_digits = strtol(spec, &end, 10);
+   if (end == spec || (*end != '\0' && *end != ':') || hdr_digits < 1 || hdr_digits > 5) {
+      fprintf(stderr, "hdr: takes 1 to 5 significant digits\n");
+      exit(0);
+   }
+   hdr_out = (*end == ':') ? end + 1 : NULL;
+   if (!(min_meas > 0 && max_meas > min_meas)) {
+      fprintf(stderr, "hdr bins need 0 < min_meas < max_meas\n");
+      exit(0);
+   }
+   hdr_shift = 23 - (int) ceil(hdr_digits*log2(10));
+
+   memcpy(&bits, &min_meas, sizeof(bits));
+   hdr_base = bits >> hdr_shift;
+   memcpy(&bits, &max_meas, sizeof(bits));
+   bin_count = (bits >> hdr_shift) - hdr_base + 1;
+
+   bits = hdr_base << hdr_shift;
+   memcpy(&lowest_edge, &bits, sizeof(bits));
+   bin_maxes = malloc(bin_count*sizeof(float));
+   for (i = 0; i < bin_count; i++) {
+      bits = (hdr_base + i + 1) << hdr_shift;
+      memcpy(&edge, &bits, sizeof(bits));
+      bin_maxes[i] = edge;
+   }
+}  /* Hdr_bins */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Grid_bins
+ * Purpose:   Set up the axes of a grid
+ * In arg:    spec:  bins for each axis, separated by commas. An axis
+ *                   can be followed by @min:max to use that range
+ *                   instead of min_meas to max_meas
+ * Notes:
+ * 1.  Each axis is set up by Setup_bins, then its bins are moved into
+ *     axes[] and the file's bins are left empty
+ * 2.  Cell numbers are row major, the last axis changes fastest
+ */
+void Grid_bins(char* spec) {
+   char *copy = strdup(spec), *item, *save, *at, *end;
+   float lo = min_meas, hi = max_meas, a_min, a_max;
+   axis* a;
+
+   for (dims = 1, at = spec; *at != '\0'; at++)
+      dims += (*at == ',');
+   axes = calloc(dims, sizeof(axis));
+   cells = 1;
+   for (a = axes, item = strtok_r(copy, ",", &save); item != NULL;
+         a++, item = strtok_r(NULL, ",", &save)) {
+      a_min = lo;
+      a_max = hi;
+      if ((at = strchr(item, '@')) != NULL) {
+         *at = '\0';
+         a_min = strtof(at + 1, &end);
+         if (*end != ':' || (a_max = strtof(end + 1, &end), *end != '\0')) {
+            fprintf(stderr, "Expected @min:max after %s\n", item);
+            exit(0);
+         }
+      }
+      Setup_bins(item, a_min, a_max);
+      a->layout = bin_layout;
+      a->count = bin_count;
+      a->tree_height = tree_height;
+      a->hdr_shift = hdr_shift;
+      a->hdr_base = hdr_base;
+      a->min = min_meas;
+      a->lowest_edge = lowest_edge;
+      a->width = bin_width;
+      a->inv_width = inv_width;
+      a->maxes = bin_maxes;
+      a->tree = tree;
+      if (cells > (1LL << 62)/bin_count) {
+         fprintf(stderr, "Too many cells in the grid\n");
+         exit(0);
+      }
+      cells *= bin_count;
+   }
+   free(copy);
+
+   min_meas = lo;
+   max_meas = hi;
+   bin_layout = GRID;
+   bin_maxes = tree = NULL;
+   sparse = cells*sizeof(long long) > SPARSE_BYTES;
+   /* dense grids are counted in the usual bins */
+   bin_count = sparse ? 0 : cells;
+}  /* Grid_bins */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Read_edges
+ * Purpose:   Read bin edges from a text file, bin i is from edge i up
+ *            to edge i+1
+ * In arg:    path:  the file, at least two edges in increasing order
+ *                   separated by white space
+ */
+void Read_edges(char* path) {
+   FILE* f = fopen(path, "r");
+   float edge;
+   int n = 0, size = 1024;
+   float* edges = malloc(size*sizeof(float));
+
+   if (f == NULL) {
+      perror(path);
+      exit(-1);
+   }
+   while (fscanf(f, "%f", &edge) == 1) {
+      if (n > 0 && !(edge > edges[n-1])) {
+         fprintf(stderr, "%s: edge %d (%f) isn't above the one before it\n",
+               path, n, edge);
+         exit(-1);
+      }
+      if (n == size) {
+         size *= 2;
+         edges = realloc(edges, size*sizeof(float));
+      }
+      edges[n++] = edge;
+   }
+   if (!feof(f) || n < 2) {
+      fprintf(stderr, "%s: expected at least two numbers\n", path);
+      exit(-1);
+   }
+   fclose(f);
+
+   lowest_edge = edges[0];
+   bin_count = n - 1;
+   bin_maxes = malloc(bin_count*sizeof(float));
+   memcpy(bin_maxes, edges + 1, bin_count*sizeof(float));
+   free(edges);
+}  /* Read_edges */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Build_tree
+ * Purpose:   Lay out the edges between bins, bin_maxes[0..bin_count-2],
+ *            as a complete binary search tree in breadth first order:
+ *            the root in tree[1] and the children of tree[k] in
+ *            tree[2k] and tree[2k+1]
+ * Notes:
+ * 1.  The tree is padded out to 2^tree_height - 1 nodes with infinity,
+ *     so every search takes tree_height steps and the leaf it ends at,
+ *     minus 2^tree_height, is the number of edges <= the point, which
+ *     is its bin
+ * 2.  tree is cache line aligned, so tree[16k..16k+15], the nodes four
+ *     levels below tree[k], are on one line
+ */
+void Build_tree(void) {
+   int n = bin_count - 1, size, k, depth, i;
+
+   for (tree_height = 0; (1 << tree_height) - 1 < n; tree_height++)
+      ;
+   size = 1 << tree_height;
+   tree = aligned_alloc(CACHE_LINE, (size*sizeof(float) + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1));
+
+   for (k = 1; k < size; k++) {
+      /* node k is at depth log2(k), its place in sorted order is the
+         middle of the range of leaves under it */
+      depth = 31 - __builtin_clz(k);
+      i = ((2*(k - (1 << depth)) + 1) << (tree_height - 1 - depth)) - 1;
+      tree[k] = (i < n) ? bin_maxes[i] : INFINITY;
+   }
+}  /* Build_tree */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Tree_bin
+ * Purpose:   Search the tree for one point, see Bin_search
+ * In arg:    x:  the measurement
+ * Return:    its bin
+ */
+int Tree_bin(float x) {
+   unsigned k = 1, bin, top = bin_count - 1;
+   int level;
+
+   for (level = 0; level < tree_height; level++)
+      k = 2*k + (tree[k] <= x);
+   bin = k - (1u << tree_height);
+   return (bin < top) ? bin : top;
+}  /* Tree_bin */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Set_dataset
+ * Purpose:   Get the next data set ready for the threads
+ * In arg:    dataset:  a number of measurements to generate, or a file
+ *                      to read them from
+ * Return:    the number of measurements this process bins
+ */
+long long Set_dataset(char* dataset) {
+   char* end;
+   long long first, count;
+
+   data_count = strtoll(dataset, &end, 10);
+   if (end == dataset || *end != '\0') {
+      Open_data(dataset);
+      data = NULL;
+      Shard(file_points, &first, &count);
+      next_offset = (off_t) first*elem_size*dims;
+      data_end = (off_t) (first + count)*elem_size*dims;
+      return count;
+   }
+   /* each process generates the same points it would alone */
+   Shard(data_count, &first, &count);
+   data_count = count;
+   data_offset = first*dims;
+   /* not touched here, each thread's slice should be first touched by
+      the thread that uses it so it lands in that thread's NUMA node */
+   data = malloc((size_t) data_count*dims*sizeof(float));
+   /* the data is generated by the threads */
+   if (mpi_rank == 0)
+      printf("Generating Data...\n");
+   return data_count;
+}  /* Set_dataset */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Shard
+ * Purpose:   Find this process' share of n points, the same way Slice
+ *            splits them between threads
+ * Out args:  first_p:  its first point
+ *            count_p:  how many
+ */
+void Shard(long long n, long long* first_p, long long* count_p) {
+   *first_p = n*mpi_rank/mpi_size;
+   *count_p = n*(mpi_rank+1)/mpi_size - *first_p;
+}  /* Shard */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Run_job
+ * Purpose:   Have the pool histogram the current data set and wait
+ *            until the total is in thread 0's bins, or bin_counts or
+ *            shared_counts for the other merge_methods
+ */
+void Run_job(void) {
+   int i;
+
+   gen_time = bin_time = merge_time = 0;
+   atomic_store(&finished, 0);
+   for (i = 0; i < bin_count && merge_method == MUTEX_MERGE; i++)
+      bin_counts[i] = 0;
+   for (i = 0; i < bin_count && merge_method == ATOMIC_MERGE; i++)
+      atomic_store_explicit(&shared_counts[i], 0, memory_order_relaxed);
+   pthread_mutex_lock(&pool_lock);
+   job++;
+   pthread_cond_broadcast(&job_cond);
+   while (jobs_done != job)
+      pthread_cond_wait(&done_cond, &pool_lock);
+   pthread_mutex_unlock(&pool_lock);
+}  /* Run_job */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Open_data
+ * Purpose:   Open a file of raw measurements for the threads to read
+ * In arg:    path:  the file, float64 values if it ends in .f64 and
+ *                   float32 otherwise, in the machine's byte order
+ */
+void Open_data(char* path) {
+   struct stat st;
+   size_t len = strlen(path);
+
+   elem_size = (len > 4 && strcmp(path + len - 4, ".f64") == 0) ? sizeof(double) : sizeof(float);
+   if ((data_fd = open(path, O_RDONLY)) == -1 || fstat(data_fd, &st) == -1) {
+      fprintf(stderr, "Could not open data file: %s\n", path);
+      exit(0);
+   }
+   /* a point is dims values, chunks hold whole points */
+   file_points = st.st_size / (elem_size*dims);
+   chunk_bytes = CHUNK_BYTES - CHUNK_BYTES % (elem_size*dims);
+   if (st.st_size % (elem_size*dims) != 0)
+      fprintf(stderr, "Ignoring %d bytes at the end of %s\n", (int) (st.st_size % (elem_size*dims)), path);
+   next_offset = 0;
+   data_end = (off_t) file_points*elem_size*dims;
+   posix_fadvise(data_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}  /* Open_data */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Read_chunk
+ * Purpose:   Take the next chunk of the data file and read it
+ * Out arg:   chunk:  CHUNK_BYTES for the chunk, the points come back
+ *                    as floats
+ * Return:    the number of points read, 0 once the file is used up
+ * Notes:
+ * 1.  float64 values are turned into floats in place, which is as
+ *     fine as the bins can tell apart anyway
+ */
+int Read_chunk(float chunk[]) {
+   off_t offset, end = data_end;
+   size_t want, have = 0;
+   ssize_t got;
+   double* wide = (double*) chunk;
+   int i, n;
+
+   pthread_mutex_lock(&chunk_lock);
+   offset = next_offset;
+   if (next_offset < end)
+      next_offset += chunk_bytes;
+   pthread_mutex_unlock(&chunk_lock);
+   if (offset >= end)
+      return 0;
+
+   want = (end - offset < chunk_bytes) ? (size_t) (end - offset) : (size_t) chunk_bytes;
+   while (have < want) {
+      got = pread(data_fd, (char*) chunk + have, want - have, offset + have);
+      if (got <= 0) {
+         perror("Could not read data file");
+         exit(-1);
+      }
+      have += got;
+   }
+   n = want / elem_size;
+   if (elem_size == sizeof(double))
+      for (i = 0; i < n; i++)
+         chunk[i] = wide[i];
+   return n;
+}  /* Read_chunk */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Count_chunk
+ * Purpose:   Bin n points and add them to a thread's totals
+ * In args:   points:          the points
+ *            n:               how many floats, dims per point
+ * Scratch:   chunk_counts:    bin_count ints
+ * In/out:    loc_bin_counts:  the thread's totals
+ *            table:           the thread's cells of a sparse grid
+ * Notes:
+ * 1.  With ATOMIC_MERGE each point is added straight to shared_counts
+ *     instead
+ */
+void Count_chunk(float points[], int n, int chunk_counts[], long long loc_bin_counts[],
+      cell_table* table) {
+   int i;
+
+   if (merge_method == ATOMIC_MERGE) {
+      for (i = 0; i < n; i++)
+         atomic_fetch_add_explicit(&shared_counts[(bin_method == SEARCH) ?
+               Tree_bin(points[i]) : Find_bin(points[i])], 1, memory_order_relaxed);
+      return;
+   }
+   memset(chunk_counts, 0, bin_count*sizeof(int));
+   if (bin_method == ND)
+      Count_grid(points, n/dims, chunk_counts, table);
+   else if (bin_method == SEARCH)
+      Bin_search(points, 0, n, chunk_counts);
+   else if (bin_layout == HDR)
+      Bin_hdr(points, 0, n, chunk_counts);
+   else
+      Bin_uniform(points, 0, n, chunk_counts);
+   for (i = 0; i < bin_count; i++)
+      loc_bin_counts[i] += chunk_counts[i];
+}  /* Count_chunk */
+
+
 /*---------------------------------------------------------------------
  * Function:  Gen_data
- * Purpose:   Generate random floats in the range min_meas <= x < max_meas
- * In args:   min_meas:    the minimum possible value for the data
- *            max_meas:    the maximum possible value for the data
- *            data_count:  the number of measurements
- * Out arg:   data:        the actual measurements
+ * Purpose:   Generate random floats for data[first..last) with the
+ *            chosen distribution
+ * In args:   min_meas:     the minimum possible value for the data
+ *            max_meas:     the maximum possible value for the data
+ *            first, last:  the points to generate
+ * Out arg:   data:         the actual measurements
+ * Notes:
+ * 1.  Point i only depends on i and the seed, so any split of the
+ *     points between threads or processes gives the same data. i is
+ *     counted from data_offset, where this process' points start
+ * 2.  uniform is min_meas <= x < max_meas. normal is centered in the
+ *     range with a standard deviation of a sixth of it, exponential
+ *     starts at min_meas with a mean of a fifth of the range. Their
+ *     tails fall outside the range and end up in the first or last bin
+ * 3.  For a grid, data[i] is on axis i % dims and uses its range
  */
 void Gen_data(
         float   min_meas    /* in  */, 
         float   max_meas    /* in  */, 
         float   data[]      /* out */,
-        int     data_count  /* in  */) {
-   int i;
+        long long first     /* in  */,
+        long long last      /* in  */) {
+   long long i;
+   uint64_t h;
+   double u, v, range = (double) max_meas - min_meas;
 
-   srandom(0);
-   for (i = 0; i < data_count; i++)
-      data[i] = min_meas + ((double)(max_meas - min_meas))*random()/((double) RAND_MAX);
+   for (i = first; i < last; i++) {
+      if (dims > 1) {
+         /* each of a point's floats is in its own axis' range */
+         min_meas = axes[i % dims].min;
+         range = (double) axes[i % dims].maxes[axes[i % dims].count - 1] - min_meas;
+      }
+      h = Hash(data_offset + i);
+      /* two 32 bit uniforms in [0, 1) */
+      u = (h >> 32) * 0x1.0p-32;
+      v = (h & 0xffffffff) * 0x1.0p-32;
+      switch (distribution) {
+      case NORMAL:
+         /* Box-Muller, 1 - u keeps the log away from 0 */
+         data[i] = min_meas + range/2 + range/6 * sqrt(-2*log(1 - u)) * cos(2*M_PI*v);
+         break;
+      case EXPONENTIAL:
+         data[i] = min_meas - range/5 * log(1 - u);
+         break;
+      default:
+         data[i] = min_meas + range*u;
+      }
+   }
 
 #  ifdef DEBUG
    printf("data = ");
-   for (i = 0; i < data_count; i++)
+   for (i = first; i < last; i++)
       printf("%4.3f ", data[i]);
    printf("\n");
 #  endif
 }  /* Gen_data */
 
 
+/*---------------------------------------------------------------------
+ * Function:  Hash
+ * Purpose:   Random bits for point i, the SplitMix64 output for
+ *            counter i of the stream picked by seed
+ * In arg:    i:  the point
+ * Return:    64 random bits
+ */
+uint64_t Hash(uint64_t i) {
+   uint64_t z = seed*0xd1342543de82ef95ULL + (i+1)*0x9e3779b97f4a7c15ULL;
+
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}  /* Hash */
+
+
 /*---------------------------------------------------------------------
  * Function:  Gen_bins
  * Purpose:   Compute max value for each bin, and store 0 as the
@@ -203,13 +1109,18 @@ void Gen_data(
  *            max_meas:   the maximum possible measurement
  *            bin_count:  the number of bins
  * Out args:  bin_maxes:  the maximum possible value for each bin
- *            bin_counts: the number of data values in each bin
+ *            bin_counts: the number of data values in each bin, can
+ *                        be NULL
+ * Notes:
+ * 1.  The bins are bin_width wide, or with bin_layout LOG each is
+ *     (max_meas/min_meas)^(1/bin_count) times as wide as the one
+ *     before it
  */
 void Gen_bins(
       float min_meas      /* in  */, 
       float max_meas      /* in  */, 
       float bin_maxes[]   /* out */, 
-      int   bin_counts[]  /* out */, 
+      long long bin_counts[]  /* out */, 
       int   bin_count     /* in  */) {
    float bin_width;
    int   i;
@@ -217,9 +1128,15 @@ void Gen_bins(
    bin_width = (max_meas - min_meas)/bin_count;
 
    for (i = 0; i < bin_count; i++) {
-      bin_maxes[i] = min_meas + (i+1)*bin_width;
-      bin_counts[i] = 0;
+      if (bin_layout == LOG)
+         bin_maxes[i] = min_meas * pow((double) max_meas/min_meas, (i+1.0)/bin_count);
+      else
+         bin_maxes[i] = min_meas + (i+1)*bin_width;
+      if (bin_counts != NULL)
+         bin_counts[i] = 0;
    }
+   if (bin_layout == LOG)
+      bin_maxes[bin_count-1] = max_meas;
 
 #  ifdef DEBUG
    printf("bin_maxes = ");
@@ -230,55 +1147,12 @@ void Gen_bins(
 }  /* Gen_bins */
 
 
-/*---------------------------------------------------------------------
- * Function:  Which_bin
- * Purpose:   Use binary search to determine which bin a measurement 
- *            belongs to
- * In args:   data:       the current measurement
- *            bin_maxes:  list of max bin values
- *            bin_count:  number of bins
- *            min_meas:   the minimum possible measurement
- * Return:    the number of the bin to which data belongs
- * Notes:      
- * 1.  The bin to which data belongs satisfies
- *
- *            bin_maxes[i-1] <= data < bin_maxes[i] 
- *
- *     where, bin_maxes[-1] = min_meas
- * 2.  If the search fails, the function prints a message and exits
- */
-int Which_bin(
-      float   data          /* in */, 
-      float   bin_maxes[]   /* in */, 
-      int     bin_count     /* in */, 
-      float   min_meas      /* in */) {
-   int bottom = 0, top =  bin_count-1;
-   int mid;
-   float bin_max, bin_min;
-
-   while (bottom <= top) {
-      mid = (bottom + top)/2;
-      bin_max = bin_maxes[mid];
-      bin_min = (mid == 0) ? min_meas: bin_maxes[mid-1];
-      if (data >= bin_max) 
-         bottom = mid+1;
-      else if (data < bin_min)
-         top = mid-1;
-      else
-         return mid;
-   }
-
-   /* Whoops! */
-   fprintf(stderr, "Data = %f doesn't belong to a bin!\n", data);
-   fprintf(stderr, "Quitting\n");
-   exit(-1);
-}  /* Which_bin */
-
-
 /*---------------------------------------------------------------------
  * Function:  Print_histo
  * Purpose:   Print a histogram.  The number of elements in each
- *            bin is shown by an array of X's.
+ *            bin is shown by an array of X's.  If a bin has more than
+ *            PRINT_WIDTH, each X stands for enough points that the
+ *            biggest bin fits and the count is printed after the X's
  * In args:   bin_maxes:   the max value for each bin
  *            bin_counts:  the number of elements in each bin
  *            bin_count:   the number of bins
@@ -286,69 +1160,1226 @@ int Which_bin(
  */
 void Print_histo(
         float  bin_maxes[]   /* in */, 
-        int    bin_counts[]  /* in */, 
+        long long bin_counts[] /* in */, 
         int    bin_count     /* in */, 
         float  min_meas      /* in */) {
-   int i, j;
+   int i;
+   long long j, most = 0, per_x;
    float bin_max, bin_min;
 
+   for (i = 0; i < bin_count; i++)
+      if (bin_counts[i] > most)
+         most = bin_counts[i];
+   per_x = (most + PRINT_WIDTH - 1)/PRINT_WIDTH;
+   if (per_x > 1)
+      printf("Each X is %lld points\n", per_x);
    for (i = 0; i < bin_count; i++) {
       bin_max = bin_maxes[i];
       bin_min = (i == 0) ? min_meas: bin_maxes[i-1];
       printf("%.3f-%.3f:\t", bin_min, bin_max);
-      for (j = 0; j < bin_counts[i]; j++)
+      for (j = 0; j < bin_counts[i]; j += per_x)
          printf("X");
+      if (per_x > 1)
+         printf(" %lld", bin_counts[i]);
       printf("\n");
    }
 }  /* Print_histo */
 
+
+/*---------------------------------------------------------------------
+ * Function:  Quantile
+ * Purpose:   Find the value at quantile q of hdr counts
+ * In args:   counts:  points in each bin
+ *            total:   sum of counts
+ *            q:       0 to 1
+ * Return:    the middle of the bin holding the ceil(q*total)-th point,
+ *            0 if there are no points
+ */
+float Quantile(long long counts[], long long total, double q) {
+   long long rank = (long long) ceil(q*total), seen = 0;
+   float bottom;
+   int i;
+
+   if (total == 0)
+      return 0;
+   if (rank < 1)
+      rank = 1;
+   for (i = 0; i < bin_count - 1; i++) {
+      seen += counts[i];
+      if (seen >= rank)
+         break;
+   }
+   bottom = (i == 0) ? lowest_edge : bin_maxes[i-1];
+   return bottom + (bin_maxes[i] - bottom)/2;
+}  /* Quantile */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Print_quantiles
+ * Purpose:   Print the percentiles of hdr counts
+ * In args:   name:    what the counts are of
+ *            counts:  points in each bin
+ *            total:   sum of counts
+ */
+void Print_quantiles(char* name, long long counts[], long long total) {
+   printf("%s: %lld points, p50 %g, p99 %g, p99.9 %g\n", name, total,
+         Quantile(counts, total, 0.5), Quantile(counts, total, 0.99),
+         Quantile(counts, total, 0.999));
+}  /* Print_quantiles */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Write_snapshot
+ * Purpose:   Save hdr counts to a file
+ * In args:   path:    the file
+ *            counts:  points in each bin
+ * Notes:
+ * 1.  The file is HDR_MAGIC, a version byte, then varints: the digits,
+ *     hdr_base and the number of entries that follow. A positive entry
+ *     is a bin's count and a negative one skips that many empty bins,
+ *     so a snapshot is a few bytes per bin that has points in it
+ */
+void Write_snapshot(char* path, long long counts[]) {
+   FILE* f = fopen(path, "wb");
+   int i, j, entries = 0, used = bin_count;
+
+   if (f == NULL) {
+      perror(path);
+      exit(-1);
+   }
+   while (used > 0 && counts[used-1] == 0)
+      used--;
+   for (i = 0; i < used; i = j) {
+      for (j = i; j < used && counts[j] == 0; j++)
+         ;
+      if (j == i)
+         j++;
+      entries++;
+   }
+
+   fwrite(HDR_MAGIC, 1, 4, f);
+   fputc(HDR_VERSION, f);
+   Put_varint(f, hdr_digits);
+   Put_varint(f, hdr_base);
+   Put_varint(f, entries);
+   for (i = 0; i < used; i = j) {
+      for (j = i; j < used && counts[j] == 0; j++)
+         ;
+      if (j == i)
+         Put_varint(f, counts[j++]);
+      else
+         Put_varint(f, -(int64_t) (j - i));
+   }
+   if (fclose(f) != 0) {
+      perror(path);
+      exit(-1);
+   }
+}  /* Write_snapshot */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Read_snapshot
+ * Purpose:   Load counts saved by Write_snapshot
+ * In arg:    path:    the file
+ * Out arg:   counts:  points in each bin
+ * Return:    the number of points
+ * Notes:
+ * 1.  The snapshot has to keep the same digits, but can cover another
+ *     range, its bins are moved to where they are in this one. Bins
+ *     outside this range go in the first or last one
+ */
+long long Read_snapshot(char* path, long long counts[]) {
+   FILE* f = fopen(path, "rb");
+   char magic[4];
+   int64_t digits, base, entries, v, bin;
+   long long total = 0;
+
+   if (f == NULL) {
+      perror(path);
+      exit(-1);
+   }
+   if (fread(magic, 1, 4, f) != 4 || memcmp(magic, HDR_MAGIC, 4) != 0
+         || fgetc(f) != HDR_VERSION || !Get_varint(f, &digits)
+         || !Get_varint(f, &base) || !Get_varint(f, &entries)) {
+      fprintf(stderr, "%s: not an hdr snapshot\n", path);
+      exit(-1);
+   }
+   if (digits != hdr_digits) {
+      fprintf(stderr, "%s: has %d digits, not %d\n", path, (int) digits, hdr_digits);
+      exit(-1);
+   }
+
+   memset(counts, 0, bin_count*sizeof(long long));
+   bin = base - hdr_base;
+   for (; entries > 0; entries--) {
+      if (!Get_varint(f, &v)) {
+         fprintf(stderr, "%s: cut short\n", path);
+         exit(-1);
+      }
+      if (v < 0) {
+         bin -= v;
+         continue;
+      }
+      counts[bin < 0 ? 0 : bin >= bin_count ? bin_count - 1 : bin] += v;
+      total += v;
+      bin++;
+   }
+   fclose(f);
+   return total;
+}  /* Read_snapshot */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Put_varint
+ * Purpose:   Write v zigzag encoded, 7 bits a byte with the top bit
+ *            set on all but the last
+ */
+void Put_varint(FILE* f, int64_t v) {
+   uint64_t u = ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+
+   while (u >= 0x80) {
+      fputc((int) (u & 0x7f) | 0x80, f);
+      u >>= 7;
+   }
+   fputc((int) u, f);
+}  /* Put_varint */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Get_varint
+ * Purpose:   Read a value written by Put_varint
+ * Return:    0 at the end of the file
+ */
+int Get_varint(FILE* f, int64_t* v_p) {
+   uint64_t u = 0;
+   int c, shift = 0;
+
+   do {
+      if ((c = fgetc(f)) == EOF || shift > 63)
+         return 0;
+      u |= (uint64_t) (c & 0x7f) << shift;
+      shift += 7;
+   } while (c & 0x80);
+   *v_p = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+   return 1;
+}  /* Get_varint */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Bin_search
+ * Purpose:   Count the points in data[first..last) by searching the
+ *            tree of bin edges, works for any bins
+ * In args:   data:            the measurements
+ *            first, last:     the range to count
+ * Out arg:   loc_bin_counts:  incremented for each point
+ * Notes:
+ * 1.  The bin a point belongs to satisfies
+ *
+ *            bin_maxes[i-1] <= data < bin_maxes[i]
+ *
+ *     Points below lowest_edge (and NaN) go in the first bin and points
+ *     at or past the last edge in the last one, like Bin_uniform
+ * 2.  Each step is a compare and a shift with no branch to mispredict.
+ *     SEARCH_LANES points go down the tree together so their misses
+ *     are in flight at the same time, and each step prefetches the
+ *     line PREFETCH_LEVELS further down
+ */
+void Bin_search(
+      float    data[]          /* in  */,
+      long long first          /* in  */,
+      long long last           /* in  */,
+      int      loc_bin_counts[] /* out */) {
+   unsigned k[SEARCH_LANES], bin, leaves = 1u << tree_height;
+   unsigned top = bin_count - 1;
+   long long i;
+   int j, m, level;
+
+   for (i = first; i < last; i += m) {
+      m = (last - i < SEARCH_LANES) ? last - i : SEARCH_LANES;
+      for (j = 0; j < m; j++)
+         k[j] = 1;
+      for (level = 0; level < tree_height; level++)
+         for (j = 0; j < m; j++) {
+            if (level + PREFETCH_LEVELS < tree_height)
+               __builtin_prefetch(tree + (k[j] << PREFETCH_LEVELS));
+            k[j] = 2*k[j] + (tree[k[j]] <= data[i+j]);
+         }
+      for (j = 0; j < m; j++) {
+         bin = k[j] - leaves;
+         /* only +inf gets past the padding */
+         loc_bin_counts[bin < top ? bin : top]++;
+      }
+   }
+}  /* Bin_search */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Bin_uniform
+ * Purpose:   Count the points in data[first..last) when every bin is
+ *            bin_width wide, using bin_method's kernel
+ * In args:   data:            the measurements
+ *            first, last:     the range to count
+ * Out arg:   loc_bin_counts:  incremented for each point
+ * Notes:
+ * 1.  The vector kernels give each lane its own copy of the bins so
+ *     lanes that land in the same bin don't wait on each other's
+ *     stores. The copies are added up at the end. With too many bins
+ *     for that to fit in cache every lane counts into loc_bin_counts
+ * 2.  Points outside [min_meas, max_meas) go in the first or last bin
+ *     like Bin_search
+ */
+void Bin_uniform(
+      float    data[]          /* in  */,
+      long long first          /* in  */,
+      long long last           /* in  */,
+      int      loc_bin_counts[] /* out */) {
+   long long i;
+   int lane, lanes = 1, stride = 0;
+   int* lane_counts = loc_bin_counts;
+
+#  ifdef HAVE_X86_SIMD
+   if (bin_method != SCALAR) {
+      lanes = (bin_method == AVX2) ? 8 : 4;
+      if (bin_count <= MAX_LANE_BINS) {
+         /* pad each copy to its own cache lines */
+         stride = (bin_count + 15) & ~15;
+         lane_counts = calloc(lanes*stride, sizeof(int));
+      }
+      if (bin_method == AVX2)
+         Bin_avx2(data, first, last, lane_counts, stride);
+      else
+         Bin_sse2(data, first, last, lane_counts, stride);
+      /* the kernels leave fewer than a vector's worth at the end */
+      first = last - (last - first) % lanes;
+   }
+#  endif
+   for (i = first; i < last; i++)
+      loc_bin_counts[Uniform_bin(data[i])]++;
+
+   if (lane_counts != loc_bin_counts) {
+      for (lane = 0; lane < lanes; lane++)
+         for (i = 0; i < bin_count; i++)
+            loc_bin_counts[i] += lane_counts[lane*stride + i];
+      free(lane_counts);
+   }
+}  /* Bin_uniform */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Uniform_bin
+ * Purpose:   Find the bin of x with a multiply
+ * In arg:    x:  the measurement
+ * Return:    the bin Bin_search would find for x
+ * Notes:
+ * 1.  The multiply can be one bin off right at an edge, so the guess is
+ *     checked against the edges worked out the same way Gen_bins does
+ *     and moved by one if need be. That keeps the counts identical to
+ *     the search
+ */
+int Uniform_bin(float x) {
+   float t = (x - min_meas) * inv_width;
+   int bin;
+
+   /* clamp before converting, NaN goes to the first bin */
+   if (!(t > 0))
+      t = 0;
+   if (t > bin_count - 1)
+      t = bin_count - 1;
+   bin = (int) t;
+   if (bin < bin_count - 1 && x >= min_meas + (bin+1)*bin_width)
+      bin++;
+   else if (bin > 0 && x < min_meas + bin*bin_width)
+      bin--;
+   return bin;
+}  /* Uniform_bin */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Bin_hdr
+ * Purpose:   Count the points in data[first..last) into hdr bins
+ * In args:   data:            the measurements
+ *            first, last:     the range to count
+ * Out arg:   loc_bin_counts:  incremented for each point
+ */
+void Bin_hdr(float data[], long long first, long long last, int loc_bin_counts[]) {
+   long long i;
+
+   for (i = first; i < last; i++)
+      loc_bin_counts[Hdr_bin(data[i])]++;
+}  /* Bin_hdr */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Hdr_bin
+ * Purpose:   Find the hdr bin of x from its bits
+ * In arg:    x:  the measurement
+ * Return:    the bin Bin_search would find for x
+ * Notes:
+ * 1.  Positive floats sort the same as their bits, so the exponent and
+ *     top mantissa bits count up through the bins
+ */
+int Hdr_bin(float x) {
+   uint32_t bits, bin;
+
+   /* below the first bin, negative or NaN */
+   if (!(x >= lowest_edge))
+      return 0;
+   memcpy(&bits, &x, sizeof(bits));
+   bin = (bits >> hdr_shift) - hdr_base;
+   return (bin < (uint32_t) bin_count) ? (int) bin : bin_count - 1;
+}  /* Hdr_bin */
+
+
+#ifdef HAVE_X86_SIMD
+/*---------------------------------------------------------------------
+ * Function:  Bin_sse2
+ * Purpose:   Uniform_bin for 4 points at a time. Lane j counts into
+ *            lane_counts[j*stride...], or into lane_counts itself when
+ *            stride is 0. Stops at the last whole vector
+ */
+void Bin_sse2(float data[], long long first, long long last, int lane_counts[], int stride) {
+   __m128 lo = _mm_set1_ps(min_meas), inv = _mm_set1_ps(inv_width);
+   __m128 width = _mm_set1_ps(bin_width), top = _mm_set1_ps(bin_count - 1);
+   __m128i one = _mm_set1_epi32(1), zero = _mm_setzero_si128();
+   __m128i last_bin = _mm_set1_epi32(bin_count - 1);
+   __m128i lane_base = _mm_setr_epi32(0, stride, 2*stride, 3*stride);
+   __m128 x, t;
+   __m128i bin, up, down;
+   long long i;
+   int j, idx[4];
+
+   for (i = first; i + 4 <= last; i += 4) {
+      x = _mm_loadu_ps(&data[i]);
+      t = _mm_mul_ps(_mm_sub_ps(x, lo), inv);
+      t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), top);
+      bin = _mm_cvttps_epi32(t);
+      /* same edge check as Uniform_bin, masks are -1 where true */
+      up = _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(x,
+            _mm_add_ps(lo, _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(bin, one)), width)))),
+            _mm_cmplt_epi32(bin, last_bin));
+      down = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(x,
+            _mm_add_ps(lo, _mm_mul_ps(_mm_cvtepi32_ps(bin), width)))),
+            _mm_cmpgt_epi32(bin, zero));
+      bin = _mm_add_epi32(_mm_sub_epi32(bin, up), down);
+      _mm_storeu_si128((__m128i*) idx, _mm_add_epi32(bin, lane_base));
+      for (j = 0; j < 4; j++)
+         lane_counts[idx[j]]++;
+   }
+}  /* Bin_sse2 */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Bin_avx2
+ * Purpose:   Bin_sse2 for 8 points at a time
+ */
+__attribute__((target("avx2")))
+void Bin_avx2(float data[], long long first, long long last, int lane_counts[], int stride) {
+   __m256 lo = _mm256_set1_ps(min_meas), inv = _mm256_set1_ps(inv_width);
+   __m256 width = _mm256_set1_ps(bin_width), top = _mm256_set1_ps(bin_count - 1);
+   __m256i one = _mm256_set1_epi32(1), zero = _mm256_setzero_si256();
+   __m256i last_bin = _mm256_set1_epi32(bin_count - 1);
+   __m256i lane_base = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+         _mm256_set1_epi32(stride));
+   __m256 x, t;
+   __m256i bin, up, down;
+   long long i;
+   int j, idx[8];
+
+   for (i = first; i + 8 <= last; i += 8) {
+      x = _mm256_loadu_ps(&data[i]);
+      t = _mm256_mul_ps(_mm256_sub_ps(x, lo), inv);
+      t = _mm256_min_ps(_mm256_max_ps(t, _mm256_setzero_ps()), top);
+      bin = _mm256_cvttps_epi32(t);
+      up = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(x,
+            _mm256_add_ps(lo, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(bin, one)), width)),
+            _CMP_GE_OQ)), _mm256_cmpgt_epi32(last_bin, bin));
+      down = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(x,
+            _mm256_add_ps(lo, _mm256_mul_ps(_mm256_cvtepi32_ps(bin), width)),
+            _CMP_LT_OQ)), _mm256_cmpgt_epi32(bin, zero));
+      bin = _mm256_add_epi32(_mm256_sub_epi32(bin, up), down);
+      _mm256_storeu_si256((__m256i*) idx, _mm256_add_epi32(bin, lane_base));
+      for (j = 0; j < 8; j++)
+         lane_counts[idx[j]]++;
+   }
+}  /* Bin_avx2 */
+#endif
+
+
+/*---------------------------------------------------------------------
+ * Function:  Pick_distribution
+ * Purpose:   Turn the optional distribution argument into a distribution
+ * In arg:    name:  uniform, normal or exponential
+ * Return:    the distribution
+ */
+int Pick_distribution(const char* name) {
+   int dist;
+
+   for (dist = UNIFORM; dist <= EXPONENTIAL; dist++)
+      if (strcmp(name, distribution_names[dist]) == 0)
+         return dist;
+   fprintf(stderr, "Unknown distribution: %s\n", name);
+   exit(0);
+}  /* Pick_distribution */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Slice
+ * Purpose:   Find the points a thread generates and bins. Slices differ
+ *            in size by at most one, so none are left over
+ * In arg:    my_rank:   the thread
+ * Out args:  first_p:   its first point
+ *            last_p:    one past its last point
+ */
+void Slice(long my_rank, long long* first_p, long long* last_p) {
+   *first_p = data_count*my_rank/thread_count;
+   *last_p = data_count*(my_rank+1)/thread_count;
+}  /* Slice */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Record_time
+ * Purpose:   Keep the longest time any thread took for a phase
+ * In arg:    elapsed:    this thread's time
+ * In/out:    slowest_p:  the longest so far
+ */
+void Record_time(double* slowest_p, double elapsed) {
+   pthread_mutex_lock(&time_lock);
+   if (elapsed > *slowest_p)
+      *slowest_p = elapsed;
+   pthread_mutex_unlock(&time_lock);
+}  /* Record_time */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Pick_method
+ * Purpose:   Turn the optional last argument into a bin_method
+ * In arg:    name:  search, scalar, sse2, avx2 or auto for the fastest
+ *                   one the cpu has, search unless the bins are equal
+ *                   width. With hdr bins scalar reads the bin from the
+ *                   float's bits
+ * Return:    the method
+ */
+int Pick_method(const char* name) {
+   int method;
+
+   for (method = SEARCH; method <= AVX2; method++)
+      if (strcmp(name, method_names[method]) == 0)
+         break;
+   if (strcmp(name, "auto") == 0) {
+      method = SCALAR;
+#     ifdef HAVE_X86_SIMD
+      method = __builtin_cpu_supports("avx2") ? AVX2 : SSE2;
+#     endif
+      if (bin_layout == HDR)
+         method = SCALAR;
+      else if (bin_layout != LINEAR)
+         method = SEARCH;
+   }
+   if (bin_layout == GRID) {
+      if (strcmp(name, "auto") != 0) {
+         fprintf(stderr, "Grids pick how to find bins for each axis, use auto\n");
+         exit(0);
+      }
+      return ND;
+   }
+   if (method != SEARCH && method <= AVX2 && bin_layout != LINEAR
+         && !(method == SCALAR && bin_layout == HDR)) {
+      fprintf(stderr, "%s only works with equal width bins\n", name);
+      exit(0);
+   }
+#  ifdef HAVE_X86_SIMD
+   if (method == AVX2 && !__builtin_cpu_supports("avx2"))
+      method = AVX2 + 1;
+#  else
+   if (method == SSE2 || method == AVX2)
+      method = AVX2 + 1;
+#  endif
+   if (method > AVX2) {
+      fprintf(stderr, "Unknown or unsupported method: %s\n", name);
+      exit(0);
+   }
+   return method;
+}  /* Pick_method */
+
+
+double Now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec/1e9;
+}  /* Now */
+
+long long Now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}  /* Now_ns */
+
 /*
- * the method run by each thread, will sort the generated data into bins
+ * the method run by each thread, will sort each data set into bins.
+ * The bins are allocated here so they are first touched by their thread
  */
 void *Thread_func(void *rank) {
 	long my_rank = (long) rank;
-	int* loc_bin_counts = malloc(bin_count * sizeof(int));
-	int i, bin;
-	int chunk_size = data_count/thread_count;
+	/* rounded up to whole cache lines so no two threads share one */
+	size_t bytes = (bin_count*sizeof(long long) + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+	long long* loc_bin_counts = aligned_alloc(CACHE_LINE, bytes);
+	int* chunk_counts = malloc(bin_count * sizeof(int));
+	int my_job = 0, done;
 	
-	for (i=0; i<bin_count; i++) { //initialize all to 0
-		loc_bin_counts[i] = 0;
+	loc_counts[my_rank] = loc_bin_counts;
+	for (;;) {
+		pthread_mutex_lock(&pool_lock);
+		while (job == my_job && !quit)
+			pthread_cond_wait(&job_cond, &pool_lock);
+		if (job == my_job) {
+			pthread_mutex_unlock(&pool_lock);
+			break;
+		}
+		my_job = job;
+		pthread_mutex_unlock(&pool_lock);
+		
+		Count_dataset(my_rank, loc_bin_counts, chunk_counts);
+		if (merge_method == TREE_MERGE) {
+			Reduce(my_rank, my_job);
+			done = my_rank == 0;
+		} else {
+			if (merge_method == MUTEX_MERGE)
+				Merge_locked(loc_bin_counts);
+			/* the last one done says so */
+			done = atomic_fetch_add(&finished, 1) + 1 == thread_count;
+		}
+		if (done) {
+			pthread_mutex_lock(&pool_lock);
+			jobs_done = my_job;
+			pthread_cond_signal(&done_cond);
+			pthread_mutex_unlock(&pool_lock);
+		}
 	}
 	
-   /* Count number of values in each bin */
-   for (i = (my_rank*chunk_size); i < ((my_rank+1)*chunk_size); i++) {
-      bin = Which_bin(data[i], bin_maxes, bin_count, min_meas);
-      loc_bin_counts[bin]++;
+	free(chunk_counts);
+	free(loc_bin_counts);
+	free(tables[my_rank].keys);
+	free(tables[my_rank].counts);
+	return NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Function:  Count_dataset
+ * Purpose:   Count this thread's share of the current data set: its
+ *            slice of the generated data, or whichever chunks of the
+ *            file it gets to first
+ * In arg:    my_rank:         the thread
+ * Scratch:   chunk_counts:    bin_count ints
+ * Out arg:   loc_bin_counts:  the thread's counts
+ */
+void Count_dataset(long my_rank, long long loc_bin_counts[], int chunk_counts[]) {
+   float* chunk;
+   long long first, last, piece;
+   int n;
+   double start, read_time = 0, count_time = 0;
+
+   memset(loc_bin_counts, 0, bin_count*sizeof(long long));
+   Table_clear(&tables[my_rank]);
+   if (data_fd < 0) {
+      /* Generate this thread's slice, then count it */
+      Slice(my_rank, &first, &last);
+      start = Now();
+      Gen_data(min_meas, max_meas, data, first*dims, last*dims);
+      read_time = Now() - start;
+      start = Now();
+      /* a chunk's worth at a time, so the int counts can't overflow */
+      for (piece = first*dims; piece < last*dims; piece += n) {
+         n = CHUNK_BYTES/sizeof(float)/dims*dims;
+         if (last*dims - piece < n)
+            n = last*dims - piece;
+         Count_chunk(data + piece, n, chunk_counts, loc_bin_counts, &tables[my_rank]);
+      }
+      count_time = Now() - start;
    }
-   
-   //for loop adding to global bin
-   for (i=0; i< bin_count; i++) {
+   else {
+      /* take chunks of the file until there are none left */
+      chunk = malloc(CHUNK_BYTES);
+      for (;;) {
+         start = Now();
+         n = Read_chunk(chunk);
+         read_time += Now() - start;
+         if (n == 0)
+            break;
+         start = Now();
+         Count_chunk(chunk, n, chunk_counts, loc_bin_counts, &tables[my_rank]);
+         count_time += Now() - start;
+      }
+      free(chunk);
+   }
+   Record_time(&gen_time, read_time);
+   Record_time(&bin_time, count_time);
+}  /* Count_dataset */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Reduce
+ * Purpose:   Add up every thread's bins into thread 0's in log2(threads)
+ *            rounds. In the round for step, a thread whose rank is a
+ *            multiple of 2*step adds in the bins of rank + step once
+ *            that thread has added up its own subtree
+ * In args:   my_rank:  the thread
+ *            my_job:   the job being reduced, what merged flags hold
+ *                      once a subtree is done
+ * Notes:
+ * 1.  Threads only wait on their partners' flags, there are no locks
+ *     and no barrier every thread has to get through
+ * 2.  A sparse grid's tables are added up the same way
+ */
+void Reduce(long my_rank, int my_job) {
+   long long *mine = loc_counts[my_rank], *theirs;
+   cell_table* table;
+   long step, partner;
+   size_t i;
+   double start, add_time = 0;
+
+   for (step = 1; step < thread_count && (my_rank & step) == 0; step <<= 1) {
+      partner = my_rank + step;
+      if (partner >= thread_count)
+         break;
+      while (atomic_load_explicit(&merged[partner*FLAG_STRIDE], memory_order_acquire) != my_job)
+         sched_yield();
+      theirs = loc_counts[partner];
+      start = Now();
+      for (i = 0; i < (size_t) bin_count; i++)
+         mine[i] += theirs[i];
+      table = &tables[partner];
+      for (i = 0; i < table->size; i++)
+         if (table->keys[i] != EMPTY_CELL)
+            Table_add(&tables[my_rank], table->keys[i], table->counts[i]);
+      add_time += Now() - start;
+   }
+   atomic_store_explicit(&merged[my_rank*FLAG_STRIDE], my_job, memory_order_release);
+   Record_time(&merge_time, add_time);
+}  /* Reduce */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Merge_locked
+ * Purpose:   Add a thread's bins to bin_counts, locking each bin
+ * In arg:    loc_bin_counts:  the thread's counts
+ */
+void Merge_locked(long long loc_bin_counts[]) {
+   double start = Now();
+   int i;
+
+   for (i = 0; i < bin_count; i++) {
       pthread_mutex_lock(&locks[i]);
-	  bin_counts[i] += loc_bin_counts[i];
-	  pthread_mutex_unlock(&locks[i]);
+      bin_counts[i] += loc_bin_counts[i];
+      pthread_mutex_unlock(&locks[i]);
    }
-   
-   Barrier();
-   
-   if (my_rank == 0) {
-      /* Print the histogram */
-      Print_histo(bin_maxes, bin_counts, bin_count, min_meas);
+   Record_time(&merge_time, Now() - start);
+}  /* Merge_locked */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Pick_merge
+ * Purpose:   Turn -M's argument into a merge_method
+ * In arg:    name:  tree, mutex or atomic
+ */
+int Pick_merge(const char* name) {
+   int merge;
+
+   for (merge = TREE_MERGE; merge <= ATOMIC_MERGE; merge++)
+      if (strcmp(name, merge_names[merge]) == 0)
+         return merge;
+   fprintf(stderr, "Unknown merge: %s\n", name);
+   exit(0);
+}  /* Pick_merge */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Axis_index
+ * Purpose:   Find n points' bins on one axis and fold them into their
+ *            cell numbers
+ * In args:   a:    the axis
+ *            x:    the points' values on this axis
+ *            n:    how many, at most GRID_BLOCK
+ * In/out:    idx:  the cell numbers so far, times a->count plus the bin
+ * Notes:
+ * 1.  The same arithmetic as Uniform_bin, Hdr_bin and Bin_search, but
+ *     with selects for the branches so each loop is straight line code
+ *     over the block that the compiler vectorizes
+ */
+VECTOR_CLONES
+void Axis_index(const axis* a, const float x[], int n, uint64_t idx[]) {
+   int bin[GRID_BLOCK], top = a->count - 1, j, level;
+   unsigned k[GRID_BLOCK], v, leaves = 1u << a->tree_height;
+   uint32_t bits;
+   float t;
+
+   switch (a->layout) {
+   case LINEAR:
+      for (j = 0; j < n; j++) {
+         t = (x[j] - a->min) * a->inv_width;
+         t = (t > 0) ? t : 0;
+         t = (t < top) ? t : top;
+         v = (int) t;
+         v += (v < (unsigned) top) & (x[j] >= a->min + (v+1)*a->width);
+         v -= (v > 0) & (x[j] < a->min + v*a->width);
+         bin[j] = v;
+      }
+      break;
+   case HDR:
+      for (j = 0; j < n; j++) {
+         memcpy(&bits, &x[j], sizeof(bits));
+         v = (bits >> a->hdr_shift) - a->hdr_base;
+         v = (v < (unsigned) top) ? v : (unsigned) top;
+         bin[j] = (x[j] >= a->lowest_edge) ? v : 0;
+      }
+      break;
+   default:
+      for (j = 0; j < n; j++)
+         k[j] = 1;
+      for (level = 0; level < a->tree_height; level++)
+         for (j = 0; j < n; j++)
+            k[j] = 2*k[j] + (a->tree[k[j]] <= x[j]);
+      for (j = 0; j < n; j++) {
+         v = k[j] - leaves;
+         bin[j] = (v < (unsigned) top) ? v : (unsigned) top;
+      }
    }
-   
-   free(loc_bin_counts);
-   return NULL;
-}
+   for (j = 0; j < n; j++)
+      idx[j] = idx[j]*a->count + bin[j];
+}  /* Axis_index */
 
-void Barrier() {
-   /* Barrier */
-   pthread_mutex_lock(&barrier_lock);
-   barrier_counter++;
-   if (barrier_counter == thread_count) {
-      barrier_counter = 0;
-      pthread_cond_broadcast(&barrier_cond);
-   } 
-   else {
-      while (pthread_cond_wait(&barrier_cond, &barrier_lock) != 0);
+
+/*---------------------------------------------------------------------
+ * Function:  Count_grid
+ * Purpose:   Count n points of a grid
+ * In args:   points:        dims floats per point
+ *            n:             how many points
+ * In/out:    chunk_counts:  a dense grid's counts
+ *            table:         a sparse grid's counts
+ */
+void Count_grid(float points[], int n, int chunk_counts[], cell_table* table) {
+   uint64_t idx[GRID_BLOCK];
+   float coord[GRID_BLOCK];
+   int i, j, m, d;
+
+   for (i = 0; i < n; i += m) {
+      m = (n - i < GRID_BLOCK) ? n - i : GRID_BLOCK;
+      for (j = 0; j < m; j++)
+         idx[j] = 0;
+      for (d = 0; d < dims; d++) {
+         for (j = 0; j < m; j++)
+            coord[j] = points[(size_t) (i+j)*dims + d];
+         Axis_index(&axes[d], coord, m, idx);
+      }
+      if (sparse)
+         for (j = 0; j < m; j++)
+            Table_add(table, idx[j], 1);
+      else
+         for (j = 0; j < m; j++)
+            chunk_counts[idx[j]]++;
    }
-   pthread_mutex_unlock(&barrier_lock);
-}
+}  /* Count_grid */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Table_add
+ * Purpose:   Add n to a cell's count in a table, growing it to stay
+ *            at most half full
+ */
+void Table_add(cell_table* table, uint64_t cell, long long n) {
+   cell_table bigger;
+   uint64_t h;
+   size_t i, mask;
+
+   if (2*(table->used + 1) > table->size) {
+      bigger.size = (table->size == 0) ? 4096 : 2*table->size;
+      bigger.keys = malloc(bigger.size*sizeof(uint64_t));
+      bigger.counts = malloc(bigger.size*sizeof(long long));
+      Table_clear(&bigger);
+      for (i = 0; i < table->size; i++)
+         if (table->keys[i] != EMPTY_CELL)
+            Table_add(&bigger, table->keys[i], table->counts[i]);
+      free(table->keys);
+      free(table->counts);
+      *table = bigger;
+   }
+
+   mask = table->size - 1;
+   h = cell*0x9e3779b97f4a7c15ULL;
+   for (i = (h ^ (h >> 32)) & mask; table->keys[i] != cell; i = (i + 1) & mask)
+      if (table->keys[i] == EMPTY_CELL) {
+         table->keys[i] = cell;
+         table->counts[i] = 0;
+         table->used++;
+         break;
+      }
+   table->counts[i] += n;
+}  /* Table_add */
+
+
+void Table_clear(cell_table* table) {
+   if (table->size > 0)
+      memset(table->keys, 0xff, table->size*sizeof(uint64_t));
+   table->used = 0;
+}  /* Table_clear */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Print_grid
+ * Purpose:   Print the grid's cells that have points, a line each
+ * In args:   counts:  a dense grid's counts
+ *            table:   a sparse grid's counts
+ */
+void Print_grid(long long counts[], cell_table* table) {
+   uint64_t* found;
+   long long cell;
+   size_t i, n = 0;
+
+   if (!sparse) {
+      for (cell = 0; cell < cells; cell++)
+         if (counts[cell] != 0)
+            Print_cell(cell, counts[cell]);
+      return;
+   }
+   /* pairs of cell and count, in cell order */
+   found = malloc(2*table->used*sizeof(uint64_t));
+   for (i = 0; i < table->size; i++)
+      if (table->keys[i] != EMPTY_CELL) {
+         found[2*n] = table->keys[i];
+         found[2*n + 1] = table->counts[i];
+         n++;
+      }
+   qsort(found, n, 2*sizeof(uint64_t), Compare_cells);
+   for (i = 0; i < n; i++)
+      Print_cell(found[2*i], found[2*i + 1]);
+   free(found);
+}  /* Print_grid */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Print_cell
+ * Purpose:   Print a cell's range on each axis and its count
+ */
+void Print_cell(uint64_t cell, long long count) {
+   int bin[dims], d;
+   float bottom;
+
+   for (d = dims - 1; d >= 0; d--) {
+      bin[d] = cell % axes[d].count;
+      cell /= axes[d].count;
+   }
+   for (d = 0; d < dims; d++) {
+      bottom = (bin[d] == 0) ? axes[d].lowest_edge : axes[d].maxes[bin[d]-1];
+      printf("%s%.3f-%.3f", (d == 0) ? "" : ", ", bottom, axes[d].maxes[bin[d]]);
+   }
+   printf(":\t%lld\n", count);
+}  /* Print_cell */
+
+
+int Compare_cells(const void* a, const void* b) {
+   uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+   return (x > y) - (x < y);
+}  /* Compare_cells */
+
+
+#ifdef USE_MPI
+/*---------------------------------------------------------------------
+ * Function:  Mpi_reduce
+ * Purpose:   Add up every process' counts on process 0
+ * In args:   points:  the points this process binned
+ * In/out:    counts:  this process' bins, the totals on process 0
+ *            table:   same for a sparse grid's cells
+ * Return:    the total number of points on process 0
+ * Notes:
+ * 1.  Counts are 64 bits, MPI_LONG_LONG. More than MPI_SEGMENT bins are
+ *     reduced in MPI_SEGMENT pieces with MPI_Ireduce, all started
+ *     before waiting on any, so the pieces go through the reduction
+ *     at the same time instead of one big message at a time
+ * 2.  Sparse grids' cells are sent to process 0 as (cell, count) pairs
+ *     and added into its table
+ */
+long long Mpi_reduce(long long counts[], cell_table* table, long long points) {
+   MPI_Request* requests;
+   uint64_t *pairs, *all = NULL;
+   int *sizes = NULL, *starts = NULL, segments, piece, n, p;
+   long long total = points, i;
+
+   MPI_Reduce(mpi_rank == 0 ? MPI_IN_PLACE : &total, &total, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+   if (!sparse) {
+      segments = (bin_count + MPI_SEGMENT - 1)/MPI_SEGMENT;
+      requests = malloc(segments*sizeof(MPI_Request));
+      for (piece = 0; piece < segments; piece++) {
+         i = (long long) piece*MPI_SEGMENT;
+         n = (bin_count - i < MPI_SEGMENT) ? bin_count - i : MPI_SEGMENT;
+         MPI_Ireduce(mpi_rank == 0 ? MPI_IN_PLACE : counts + i, counts + i, n,
+               MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD, &requests[piece]);
+      }
+      MPI_Waitall(segments, requests, MPI_STATUSES_IGNORE);
+      free(requests);
+      return total;
+   }
+
+   /* process 0 keeps its own cells where they are */
+   n = 0;
+   pairs = malloc((mpi_rank == 0 ? 1 : 2*table->used)*sizeof(uint64_t));
+   for (i = 0; mpi_rank != 0 && i < (long long) table->size; i++)
+      if (table->keys[i] != EMPTY_CELL) {
+         pairs[n++] = table->keys[i];
+         pairs[n++] = table->counts[i];
+      }
+   if (mpi_rank == 0) {
+      sizes = malloc(mpi_size*sizeof(int));
+      starts = malloc(mpi_size*sizeof(int));
+   }
+   MPI_Gather(&n, 1, MPI_INT, sizes, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   if (mpi_rank == 0) {
+      for (p = 0, n = 0; p < mpi_size; p++) {
+         starts[p] = n;
+         n += sizes[p];
+      }
+      all = malloc((n > 0 ? n : 1)*sizeof(uint64_t));
+      n = 0;
+   }
+   MPI_Gatherv(pairs, n, MPI_UINT64_T, all, sizes, starts, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+   if (mpi_rank == 0) {
+      for (p = 0; p < mpi_size; p++)
+         for (i = starts[p]; i < starts[p] + sizes[p]; i += 2)
+            Table_add(table, all[i], all[i+1]);
+      free(all);
+      free(sizes);
+      free(starts);
+   }
+   free(pairs);
+   return total;
+}  /* Mpi_reduce */
+#endif
+
+
+/*---------------------------------------------------------------------
+ * Function:  Live_create
+ * Purpose:   Make a histogram of recent values with the bins from
+ *            Setup_bins
+ * In args:   slices:         how many slices are kept
+ *            slice_seconds:  how long each one is
+ *            max_threads:    threads that can record into it at
+ *                            once
+ * Return:    the histogram, NULL if there isn't memory for it, a
+ *            thread specific key, or the bins are a grid
+ * Notes:
+ * 1.  Each thread gets a shard with its own counts for every slice, so
+ *     recording is a plain load and store to memory no other thread
+ *     writes. A slot in the ring of slices is cleared by its thread
+ *     when it first records in a new slice there
+ * 2.  A thread gives its shard back when it exits, the next thread to
+ *     take it carries on adding to the counts already there
+ */
+live_histo* Live_create(int slices, double slice_seconds, int max_threads) {
+   live_histo* h = calloc(1, sizeof(live_histo));
+   int i;
+
+   if (h == NULL || bin_layout == GRID || slices < 1 || max_threads < 1 || !(slice_seconds > 0)) {
+      free(h);
+      return NULL;
+   }
+   h->slices = slices;
+   h->shards = max_threads;
+   h->slice_ns = (long long) (slice_seconds*1e9);
+   if (h->slice_ns < 1)
+      h->slice_ns = 1;
+   /* the slice numbers take whole cache lines */
+   h->head = (slices + FLAG_LLONGS - 1)/FLAG_LLONGS*FLAG_LLONGS;
+   atomic_init(&h->dropped, 0);
+   /* shards are made by their threads so the memory is near them */
+   h->shard = malloc(max_threads*sizeof(_Atomic(atomic_llong*)));
+   h->owned = malloc(max_threads*sizeof(atomic_int));
+   if (h->shard == NULL || h->owned == NULL
+         || pthread_key_create(&h->key, Live_release) != 0) {
+      free(h->shard);
+      free(h->owned);
+      free(h);
+      return NULL;
+   }
+   for (i = 0; i < max_threads; i++) {
+      atomic_init(&h->shard[i], NULL);
+      atomic_init(&h->owned[i], 0);
+   }
+   return h;
+}  /* Live_create */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Live_shard
+ * Purpose:   Get the calling thread's shard, taking a free one the
+ *            first time and making it if no thread has used it yet
+ * In arg:    h:  the histogram
+ * Return:    the shard, NULL if h->shards threads already have one or
+ *            there isn't memory
+ * Notes:
+ * 1.  The shard is slices slice numbers padded to a cache line,
+ *     followed by slices rows of bin_count counts. A slot whose slice
+ *     number isn't the current slice is stale and holds CLEARING while
+ *     it is being zeroed
+ * 2.  A thread that finds none free looks again on its next record
+ */
+atomic_llong* Live_shard(live_histo* h) {
+   atomic_int* owned = pthread_getspecific(h->key);
+   atomic_llong* shard;
+   size_t bytes;
+   int i, t, free_shard;
+
+   if (owned == NULL) {
+      for (t = 0; t < h->shards; t++) {
+         free_shard = 0;
+         /* acquire so the last owner's counts are seen before adding */
+         if (atomic_load_explicit(&h->owned[t], memory_order_relaxed) == 0
+               && atomic_compare_exchange_strong_explicit(&h->owned[t], &free_shard, 1,
+                  memory_order_acquire, memory_order_relaxed))
+            break;
+      }
+      if (t == h->shards)
+         return NULL;
+      owned = &h->owned[t];
+      if (pthread_setspecific(h->key, owned) != 0) {
+         atomic_store_explicit(owned, 0, memory_order_release);
+         return NULL;
+      }
+   }
+   t = owned - h->owned;
+   shard = atomic_load_explicit(&h->shard[t], memory_order_relaxed);
+   if (shard != NULL)
+      return shard;
+
+   bytes = (h->head + (size_t) h->slices*bin_count)*sizeof(atomic_llong);
+   shard = aligned_alloc(CACHE_LINE, (bytes + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1));
+   if (shard == NULL)
+      return NULL;
+   for (i = 0; i < h->slices; i++)
+      atomic_init(&shard[i], CLEARING);
+   memset(shard + h->head, 0, bytes - h->head*sizeof(atomic_llong));
+   atomic_store_explicit(&h->shard[t], shard, memory_order_release);
+   return shard;
+}  /* Live_shard */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Live_release
+ * Purpose:   Give an exiting thread's shard back, called by pthreads
+ *            with the thread's value for a histogram's key
+ * In arg:    owned:  the shard's h->owned entry
+ */
+void Live_release(void* owned) {
+   atomic_store_explicit((atomic_int*) owned, 0, memory_order_release);
+}  /* Live_release */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Live_record
+ * Purpose:   Count a value in the current slice
+ * In args:   h:  the histogram
+ *            x:  the value
+ * Return:    1, or 0 if it could only be counted as dropped
+ * Notes:
+ * 1.  Wait free, the only other work ever done is clearing a slot once
+ *     a slice. That is done like a seqlock write: the slot is marked
+ *     CLEARING, zeroed, then given its new slice number, so a reader
+ *     that sees the same slice number before and after reading a slot
+ *     knows it wasn't cleared in between
+ */
+int Live_record(live_histo* h, float x) {
+   long long slice = Now_ns()/h->slice_ns;
+   int slot = slice % h->slices, i;
+   atomic_llong *shard = Live_shard(h), *row, *count;
+
+   if (shard == NULL) {
+      atomic_fetch_add_explicit(&h->dropped, 1, memory_order_relaxed);
+      return 0;
+   }
+   row = shard + h->head + (size_t) slot*bin_count;
+   if (atomic_load_explicit(&shard[slot], memory_order_relaxed) != slice) {
+      atomic_store_explicit(&shard[slot], CLEARING, memory_order_relaxed);
+      atomic_thread_fence(memory_order_release);
+      for (i = 0; i < bin_count; i++)
+         atomic_store_explicit(&row[i], 0, memory_order_relaxed);
+      atomic_store_explicit(&shard[slot], slice, memory_order_release);
+   }
+   /* only this thread writes the count */
+   count = &row[Find_bin(x)];
+   atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+         memory_order_relaxed);
+   return 1;
+}  /* Live_record */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Live_snapshot
+ * Purpose:   Add up the most recent slices
+ * In args:   h:               the histogram
+ *            window_seconds:  how far back to go, rounded up to whole
+ *                             slices and cut to the slices kept
+ * Out arg:   counts:          bin_count totals
+ * Return:    the number of points in the window
+ * Notes:
+ * 1.  Writers aren't stopped. A slot is used if it holds one of the
+ *     slices in the window before and after its counts are read, a slot
+ *     that is cleared meanwhile has moved past the window. Points
+ *     recorded during the snapshot may or may not be in it
+ */
+long long Live_snapshot(live_histo* h, double window_seconds, long long counts[]) {
+   long long now = Now_ns()/h->slice_ns, first, held, total = 0;
+   long long window = (long long) ceil(window_seconds*1e9/h->slice_ns);
+   long long* sums = malloc(bin_count*sizeof(long long));
+   atomic_llong *shard, *row;
+   int t, slot, i;
+
+   if (window < 1)
+      window = 1;
+   if (window > h->slices)
+      window = h->slices;
+   first = now - window + 1;
+   memset(counts, 0, bin_count*sizeof(long long));
+   for (t = 0; t < h->shards; t++) {
+      shard = atomic_load_explicit(&h->shard[t], memory_order_acquire);
+      if (shard == NULL)
+         continue;
+      for (slot = 0; slot < h->slices; slot++) {
+         held = atomic_load_explicit(&shard[slot], memory_order_acquire);
+         if (held < first || held > now)
+            continue;
+         row = shard + h->head + (size_t) slot*bin_count;
+         for (i = 0; i < bin_count; i++)
+            sums[i] = atomic_load_explicit(&row[i], memory_order_relaxed);
+         atomic_thread_fence(memory_order_acquire);
+         if (atomic_load_explicit(&shard[slot], memory_order_relaxed) != held)
+            continue;
+         for (i = 0; i < bin_count; i++) {
+            counts[i] += sums[i];
+            total += sums[i];
+         }
+      }
+   }
+   free(sums);
+   return total;
+}  /* Live_snapshot */
+
+
+long long Live_dropped(live_histo* h) {
+   return atomic_load_explicit(&h->dropped, memory_order_relaxed);
+}  /* Live_dropped */
+
+
+/*---------------------------------------------------------------------
+ * Function:  Live_free
+ * Purpose:   Free a histogram, nothing can be recording into it
+ */
+void Live_free(live_histo* h) {
+   int t;
+
+   /* threads still holding shards won't try to give them back */
+   pthread_key_delete(h->key);
+   for (t = 0; t < h->shards; t++)
+      free(h->shard[t]);
+   free(h->shard);
+   free((void*) h->owned);
+   free(h);
+}  /* Live_free */
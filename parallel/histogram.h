@@ -0,0 +1,52 @@
+/* File:      histogram.h
+ * The bins from histogram.c for programs that want to count values as
+ * they come in instead of in one batch. Build histogram.c with
+ * -DHISTOGRAM_LIB to leave out its main and link it in.
+ *
+ *    Setup_bins("hdr:3", 0.001, 60);     // the same bins as the program
+ *    live_histo* h = Live_create(60, 1.0, 64);   // 60 one second slices
+ *    Live_record(h, latency);            // from any thread
+ *    total = Live_snapshot(h, 10.0, counts);     // the last 10 seconds
+ *
+ * counts has bin_count entries, bin i goes up to bin_maxes[i] and bin 0
+ * starts at lowest_edge.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+typedef struct live_histo live_histo;
+
+extern int bin_count;
+extern float* bin_maxes;
+extern float lowest_edge;
+
+/* Set up the bins for every histogram in the process, bin_spec is the
+   program's bin_count argument: a number, log:number, hdr:digits or a
+   file of edges. Exits on a bad spec like the program does */
+void Setup_bins(char* bin_spec, float min, float max);
+
+/* The bin of x, points outside the bins go in the first or last one */
+int Find_bin(float x);
+
+/* A histogram of the last slices*slice_seconds seconds that up to
+   max_threads threads at a time can record into. A thread's place is
+   given back when it exits, so pools and short lived threads are fine
+   as long as no more than max_threads are recording at once. NULL if
+   out of memory, or if the bins are a grid, which these don't handle */
+live_histo* Live_create(int slices, double slice_seconds, int max_threads);
+
+/* Count x in the current slice. Never blocks. Returns 0 if max_threads
+   other live threads have already recorded, the point is only counted
+   in Live_dropped then */
+int Live_record(live_histo* h, float x);
+
+/* Add up the last window_seconds (rounded up to whole slices, at most
+   all of them) into counts without stopping the writers. Returns the
+   number of points */
+long long Live_snapshot(live_histo* h, double window_seconds, long long counts[]);
+
+long long Live_dropped(live_histo* h);
+
+void Live_free(live_histo* h);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * Benchmarks histogram.c. Runs it once for every combination of thread
+ * count, bin count, number of points, distribution and variant, printing
+ * a CSV row per run. The times come from the lines histogram prints on
+ * stderr, so it has to be built from the same tree:
+ *
+ *	gcc -O2 -pthread histogram.c -o histogram -lm
+ *	gcc -O2 histogram_bench.c -o histogram_bench
+ *	./histogram_bench -t 1,2,4,8 -b 10,1000,100000,10000000 -V tree,mutex,atomic > results.csv
+ *
+ * A variant is a merge (tree, mutex or atomic, see -M in histogram.c)
+ * and optionally a + and the binning method, e.g. -V tree+search,tree+avx2
+ * compares searching the bin edges with working the bin out. The
+ * distributions are histogram's uniform, normal and exponential, the
+ * last two pile most points into a few bins.
+ *
+ * points_per_s counts binning and merging but not making up the data.
+ * scaling_eff is points_per_s over the first thread count's (the mean of
+ * its runs) divided by the ratio of the thread counts, so 1.0 is perfect
+ * scaling; the first thread count in -t is the baseline.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define MAX_LIST 32 /* most values in one comma separated list */
+#define MAX_ARGS 16
+
+/*
+ * what one run of histogram reported
+ */
+typedef struct result_type {
+	double wall_s, gen_s, bin_s, merge_s;
+	long long points;
+} result;
+
+void usage(const char* name);
+
+int parse_list(char* arg, char* items[]);
+
+int run(char* argv[], result* r);
+
+void read_times(FILE* fp, result* r);
+
+double now();
+
+int main(int argc, char* argv[]) {
+	const char *binary = "./histogram", *min_meas = "0", *max_meas = "100", *seed = "1";
+	char default_t[] = "1,2,4", default_b[] = "10,1000,100000", default_n[] = "10000000";
+	char default_d[] = "uniform", default_v[] = "tree,mutex,atomic";
+	char *t_arg = default_t, *b_arg = default_b, *n_arg = default_n, *d_arg = default_d;
+	char *v_arg = default_v;
+	char *threads[MAX_LIST], *bins[MAX_LIST], *points[MAX_LIST], *dists[MAX_LIST];
+	char *variants[MAX_LIST], *args[MAX_ARGS], merge[64], *method;
+	int num_t, num_b, num_n, num_d, num_v, repeats = 1;
+	int opt, t, b, n, d, v, rep, base_runs;
+	double rate, base_rate, eff;
+	result r;
+
+	while ((opt = getopt(argc, argv, "b:d:m:n:r:S:t:V:x:X:")) != -1) {
+		switch (opt) {
+		case 't':
+			t_arg = optarg;
+			break;
+		case 'b': /* bin counts, or any bins histogram takes */
+			b_arg = optarg;
+			break;
+		case 'n': /* points to make up */
+			n_arg = optarg;
+			break;
+		case 'd': /* distributions */
+			d_arg = optarg;
+			break;
+		case 'V':
+			v_arg = optarg;
+			break;
+		case 'm': /* range of the bins */
+			min_meas = optarg;
+			break;
+		case 'X':
+			max_meas = optarg;
+			break;
+		case 'S': /* seed, the same seed gives the same points */
+			seed = optarg;
+			break;
+		case 'x': /* histogram to run */
+			binary = optarg;
+			break;
+		case 'r': /* runs of each combination */
+			repeats = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (repeats < 1)
+		usage(argv[0]);
+	num_t = parse_list(t_arg, threads);
+	num_b = parse_list(b_arg, bins);
+	num_n = parse_list(n_arg, points);
+	num_d = parse_list(d_arg, dists);
+	num_v = parse_list(v_arg, variants);
+
+	printf("variant,merge,method,threads,bins,points,distribution,run,gen_s,bin_s,merge_s,"
+			"wall_s,points_per_s,scaling_eff\n");
+	for (v=0; v<num_v; v++)
+	for (b=0; b<num_b; b++)
+	for (n=0; n<num_n; n++)
+	for (d=0; d<num_d; d++) {
+		base_rate = 0;
+		base_runs = 0;
+		for (t=0; t<num_t; t++)
+		for (rep=0; rep<repeats; rep++) {
+			/* merge+method, the method defaults to histogram's auto */
+			snprintf(merge, sizeof(merge), "%s", variants[v]);
+			if ((method = strchr(merge, '+')) != NULL)
+				*method++ = '\0';
+			else
+				method = "auto";
+			args[0] = (char*) binary;
+			args[1] = "-M";
+			args[2] = merge;
+			args[3] = threads[t];
+			args[4] = bins[b];
+			args[5] = (char*) min_meas;
+			args[6] = (char*) max_meas;
+			args[7] = points[n];
+			args[8] = method;
+			args[9] = dists[d];
+			args[10] = (char*) seed;
+			args[11] = NULL;
+			if (!run(args, &r)) {
+				fprintf(stderr, "Run of variant %s with %s threads and %s bins failed\n",
+						variants[v], threads[t], bins[b]);
+				continue;
+			}
+			rate = (r.bin_s + r.merge_s > 0) ? r.points / (r.bin_s + r.merge_s) : 0;
+			if (t == 0) {
+				base_rate += rate;
+				base_runs++;
+			}
+			eff = (base_runs > 0 && base_rate > 0) ?
+					rate / (base_rate / base_runs) * atof(threads[0]) / atof(threads[t]) : 0;
+			printf("%s,%s,%s,%s,%s,%s,%s,%d,%.3f,%.6f,%.6f,%.4f,%.0f,%.3f\n",
+					variants[v], merge, method, threads[t], bins[b], points[n], dists[d], rep,
+					r.gen_s, r.bin_s, r.merge_s, r.wall_s, rate, eff);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
+
+void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-x histogram] [-t threads,...] [-b bins,...] [-n points,...] "
+			"[-d uniform|normal|exponential,...] [-V merge[+method],...] [-m min_meas] "
+			"[-X max_meas] [-S seed] [-r runs]\n", name);
+	exit(0);
+}
+
+/*
+ * splits a comma separated list in place, returns how many items
+ */
+int parse_list(char* arg, char* items[]) {
+	int n = 0;
+	char *item, *save;
+	for (item = strtok_r(arg, ",", &save); item != NULL && n < MAX_LIST; item = strtok_r(NULL, ",", &save))
+		items[n++] = item;
+	if (n == 0) {
+		fprintf(stderr, "Empty list\n");
+		exit(1);
+	}
+	return n;
+}
+
+/*
+ * runs histogram with the histogram itself thrown away and reads the
+ * times off its stderr. Returns 0 if it didn't exit cleanly
+ */
+int run(char* argv[], result* r) {
+	pid_t pid;
+	int status, fd, pipe_fds[2];
+	double start = now();
+	FILE* fp;
+
+	if (pipe(pipe_fds) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	if ((pid = fork()) == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, STDOUT_FILENO);
+		dup2(pipe_fds[1], STDERR_FILENO);
+		close(fd);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	close(pipe_fds[1]);
+	fp = fdopen(pipe_fds[0], "r");
+	read_times(fp, r);
+	fclose(fp);
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return 0;
+	r->wall_s = now() - start;
+	return r->points > 0;
+}
+
+/*
+ * picks the generate and binning times out of histogram's stderr, the
+ * lines start with the method's name so skip up to the ": "
+ */
+void read_times(FILE* fp, result* r) {
+	char line[1024], *text;
+	long long count;
+
+	memset(r, 0, sizeof(*r));
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((text = strstr(line, ": ")) == NULL)
+			continue;
+		text += 2;
+		if (sscanf(text, "binned %lld points in %lf seconds, merged in %lf seconds",
+				&r->points, &r->bin_s, &r->merge_s) == 3)
+			continue;
+		if (sscanf(text, "generated %lld %*s points in %lf seconds", &count, &r->gen_s) != 2)
+			fputs(line, stderr);
+	}
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
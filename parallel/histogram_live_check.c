@@ -0,0 +1,126 @@
+/*
+ * Checks the live histograms in histogram.h with threads that come and
+ * go: a histogram keeps taking points however many threads have ever
+ * recorded into it, as long as no more than max_threads are at it at
+ * once, and histograms don't use up each other's places.
+ *
+ *	gcc -O2 -pthread -DHISTOGRAM_LIB -c histogram.c -o histogram.o
+ *	gcc -O2 -pthread histogram_live_check.c histogram.o -o histogram_live_check -lm
+ *	./histogram_live_check
+ *
+ * Prints what it checked and exits 1 if anything was off.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "histogram.h"
+
+#define MAX_THREADS 4
+#define ROUNDS 50
+#define POINTS 1000 /* per thread */
+
+/*
+ * what a recording thread does
+ */
+typedef struct job_type {
+	live_histo *h, *other; /* other can be NULL */
+	pthread_barrier_t* hold; /* if not NULL, waits here after recording and
+				    again before exiting */
+	int recorded;
+} job;
+
+void* record(void* arg);
+
+int check(const char* what, long long got, long long want);
+
+int main() {
+	live_histo *h, *h2;
+	pthread_t threads[MAX_THREADS + 1];
+	job jobs[MAX_THREADS + 1];
+	pthread_barrier_t hold;
+	long long* counts;
+	int failed = 0, round, i;
+	char spec[] = "10";
+
+	Setup_bins(spec, 0, 10);
+	counts = malloc(bin_count * sizeof(long long));
+
+	/* fresh threads every round, far more than MAX_THREADS in all */
+	h = Live_create(60, 1.0, MAX_THREADS);
+	for (round=0; round<ROUNDS; round++) {
+		for (i=0; i<2; i++) {
+			jobs[i] = (job) {h, NULL, NULL, 0};
+			pthread_create(&threads[i], NULL, record, &jobs[i]);
+		}
+		for (i=0; i<2; i++)
+			pthread_join(threads[i], NULL);
+	}
+	failed |= check("churned threads, total", Live_snapshot(h, 60, counts), 2LL * ROUNDS * POINTS);
+	failed |= check("churned threads, dropped", Live_dropped(h), 0);
+	Live_free(h);
+
+	/* one more than fits at once is dropped, and gets in once the
+	   others are gone */
+	h = Live_create(60, 1.0, MAX_THREADS);
+	pthread_barrier_init(&hold, NULL, MAX_THREADS + 1);
+	for (i=0; i<MAX_THREADS; i++) {
+		jobs[i] = (job) {h, NULL, &hold, 0};
+		pthread_create(&threads[i], NULL, record, &jobs[i]);
+	}
+	jobs[MAX_THREADS] = (job) {h, NULL, NULL, 0};
+	/* the others have recorded once they reach the barrier */
+	pthread_barrier_wait(&hold);
+	pthread_create(&threads[MAX_THREADS], NULL, record, &jobs[MAX_THREADS]);
+	pthread_join(threads[MAX_THREADS], NULL);
+	failed |= check("thread past max_threads, recorded", jobs[MAX_THREADS].recorded, 0);
+	pthread_barrier_wait(&hold);
+	for (i=0; i<MAX_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	pthread_create(&threads[0], NULL, record, &jobs[MAX_THREADS]);
+	pthread_join(threads[0], NULL);
+	failed |= check("new thread after the others left, recorded", jobs[MAX_THREADS].recorded, POINTS);
+	failed |= check("too many threads, dropped", Live_dropped(h), POINTS);
+	pthread_barrier_destroy(&hold);
+	Live_free(h);
+
+	/* a thread in two histograms takes a place in each */
+	h = Live_create(60, 1.0, 1);
+	h2 = Live_create(60, 1.0, 1);
+	for (i=0; i<3; i++) {
+		jobs[i] = (job) {h, h2, NULL, 0};
+		pthread_create(&threads[i], NULL, record, &jobs[i]);
+		pthread_join(threads[i], NULL);
+	}
+	failed |= check("two histograms, first", Live_snapshot(h, 60, counts), 3 * POINTS);
+	failed |= check("two histograms, second", Live_snapshot(h2, 60, counts), 3 * POINTS);
+	Live_free(h);
+	Live_free(h2);
+
+	free(counts);
+	return failed;
+}
+
+void* record(void* arg) {
+	job* j = arg;
+	int i;
+
+	j->recorded = 0;
+	for (i=0; i<POINTS; i++) {
+		j->recorded += Live_record(j->h, (i % 100) / 10.0f);
+		if (j->other != NULL)
+			Live_record(j->other, (i % 100) / 10.0f);
+	}
+	if (j->hold != NULL) {
+		pthread_barrier_wait(j->hold);
+		pthread_barrier_wait(j->hold);
+	}
+	return NULL;
+}
+
+/*
+ * prints one line per check, returns 1 if it failed
+ */
+int check(const char* what, long long got, long long want) {
+	printf("%-45s %8lld %s\n", what, got, (got == want) ? "ok" : "WRONG");
+	return got != want;
+}
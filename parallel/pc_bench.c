@@ -0,0 +1,407 @@
+/*
+ * Benchmarks producer_consumer.c. Writes a synthetic corpus with a set
+ * number of files, file size, line length and token distribution, then
+ * runs the tokenizer over it once for every combination of producers,
+ * consumers, queue size, batch size and variant, printing a CSV row per
+ * run. Throughput and per-line latency come from the tokenizer's own -j
+ * counters, so it has to be built from the same tree:
+ *
+ *	gcc -O2 -fopenmp producer_consumer.c -o producer_consumer
+ *	gcc -O2 pc_bench.c -o pc_bench -lm
+ *	./pc_bench -n 8 -s 64M -p 1,2,4 -c 1,2,4 -q 16,256 > results.csv
+ *
+ * A variant is a list of + separated options for the tokenizer: mmap
+ * (the default), stdio (-s), ordered (-o), count (-a) and table, sse2 or
+ * avx2 to pick the tokenizer (-m), e.g. -V mmap,stdio+ordered
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_LIST 32 /* most values in one comma separated list */
+#define MAX_ARGS 64
+
+/*
+ * what the generated corpus looks like
+ */
+typedef struct corpus_spec_type {
+	int files;
+	size_t file_size;
+	int line_tokens; /* mean tokens per line */
+	int token_len; /* mean token length */
+	int vocab; /* distinct tokens */
+	double zipf; /* skew of token frequencies, 0 for uniform */
+	uint64_t seed;
+} corpus_spec;
+
+/*
+ * what one run of the tokenizer reported
+ */
+typedef struct result_type {
+	double wall_s, elapsed_s;
+	unsigned long long lines, bytes, tokens, full_ns, empty_ns;
+	unsigned long long p50_ns, p99_ns;
+} result;
+
+void usage(const char* name);
+
+int parse_list(char* arg, char* items[]);
+
+size_t parse_size(const char* arg);
+
+uint64_t next_random(uint64_t* state);
+
+void make_corpus(const corpus_spec* spec, const char* dir);
+
+int run(char* argv[], const char* json, result* r);
+
+int read_stats(const char* json, result* r);
+
+unsigned long long json_number(const char* text, const char* after, const char* key);
+
+double now();
+
+int main(int argc, char* argv[]) {
+	corpus_spec spec = {4, 16*1024*1024, 12, 6, 50000, 1.0, 1};
+	const char *binary = "./producer_consumer", *dir = "pc_bench_corpus";
+	char default_p[] = "1,2", default_c[] = "1,2", default_q[] = "64", default_b[] = "65536";
+	char default_v[] = "mmap";
+	char *p_arg = default_p, *c_arg = default_c, *q_arg = default_q, *b_arg = default_b;
+	char *v_arg = default_v;
+	char *producers[MAX_LIST], *consumers[MAX_LIST], *queues[MAX_LIST], *batches[MAX_LIST];
+	char *variants[MAX_LIST], **args, **files, json[4096], flags[256];
+	char *flag, *save;
+	int num_p, num_c, num_q, num_b, num_v, repeats = 1, generate = 1;
+	int opt, i, p, c, q, b, v, rep, n;
+	result r;
+
+	while ((opt = getopt(argc, argv, "b:c:d:Gl:L:n:p:q:r:s:S:V:w:x:z:")) != -1) {
+		switch (opt) {
+		case 'n': /* number of files */
+			spec.files = strtol(optarg, NULL, 10);
+			break;
+		case 's': /* bytes per file, K, M and G suffixes work */
+			spec.file_size = parse_size(optarg);
+			break;
+		case 'l': /* mean tokens per line */
+			spec.line_tokens = strtol(optarg, NULL, 10);
+			break;
+		case 'L': /* mean token length */
+			spec.token_len = strtol(optarg, NULL, 10);
+			break;
+		case 'w': /* vocabulary size */
+			spec.vocab = strtol(optarg, NULL, 10);
+			break;
+		case 'z': /* zipf exponent of token frequencies, 0 is uniform */
+			spec.zipf = strtod(optarg, NULL);
+			break;
+		case 'S': /* seed, the same seed gives the same corpus */
+			spec.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'd': /* where the corpus goes */
+			dir = optarg;
+			break;
+		case 'G': /* reuse the corpus already in the directory */
+			generate = 0;
+			break;
+		case 'x': /* tokenizer to run */
+			binary = optarg;
+			break;
+		case 'p':
+			p_arg = optarg;
+			break;
+		case 'c':
+			c_arg = optarg;
+			break;
+		case 'q':
+			q_arg = optarg;
+			break;
+		case 'b':
+			b_arg = optarg;
+			break;
+		case 'V':
+			v_arg = optarg;
+			break;
+		case 'r': /* runs of each combination */
+			repeats = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (spec.files < 1 || spec.line_tokens < 1 || spec.token_len < 1 || spec.vocab < 1)
+		usage(argv[0]);
+	num_p = parse_list(p_arg, producers);
+	num_c = parse_list(c_arg, consumers);
+	num_q = parse_list(q_arg, queues);
+	num_b = parse_list(b_arg, batches);
+	num_v = parse_list(v_arg, variants);
+
+	if (generate)
+		make_corpus(&spec, dir);
+	files = malloc(spec.files * sizeof(char*));
+	args = malloc((MAX_ARGS + spec.files + 1) * sizeof(char*));
+	for (i=0; i<spec.files; i++) {
+		files[i] = malloc(strlen(dir) + 32);
+		sprintf(files[i], "%s/corpus_%03d.txt", dir, i);
+	}
+	snprintf(json, sizeof(json), "%s/stats.json", dir);
+
+	printf("variant,producers,consumers,queue,batch,run,lines,bytes,tokens,wall_s,elapsed_s,"
+			"mb_per_s,tokens_per_s,p50_line_ns,p99_line_ns,blocked_full_ms,blocked_empty_ms\n");
+	for (v=0; v<num_v; v++)
+	for (p=0; p<num_p; p++)
+	for (c=0; c<num_c; c++)
+	for (q=0; q<num_q; q++)
+	for (b=0; b<num_b; b++)
+	for (rep=0; rep<repeats; rep++) {
+		n = 0;
+		args[n++] = (char*) binary;
+		args[n++] = "-p";
+		args[n++] = producers[p];
+		args[n++] = "-c";
+		args[n++] = consumers[c];
+		args[n++] = "-b";
+		args[n++] = batches[b];
+		args[n++] = "-j";
+		args[n++] = json;
+		/* the variant's own options, strtok_r needs its own copy */
+		snprintf(flags, sizeof(flags), "%s", variants[v]);
+		for (flag = strtok_r(flags, "+", &save); flag != NULL; flag = strtok_r(NULL, "+", &save)) {
+			if (strcmp(flag, "stdio") == 0)
+				args[n++] = "-s";
+			else if (strcmp(flag, "ordered") == 0)
+				args[n++] = "-o";
+			else if (strcmp(flag, "count") == 0)
+				args[n++] = "-a";
+			else if (strcmp(flag, "table") == 0 || strcmp(flag, "sse2") == 0 || strcmp(flag, "avx2") == 0) {
+				args[n++] = "-m";
+				args[n++] = flag;
+			}
+			else if (strcmp(flag, "mmap") != 0) {
+				fprintf(stderr, "Unknown variant option \"%s\"\n", flag);
+				exit(1);
+			}
+			if (n > MAX_ARGS - 8) {
+				fprintf(stderr, "Variant \"%s\" has too many options\n", variants[v]);
+				exit(1);
+			}
+		}
+		args[n++] = queues[q];
+		for (i=0; i<spec.files; i++)
+			args[n + i] = files[i];
+		args[n + spec.files] = NULL;
+		if (!run(args, json, &r)) {
+			fprintf(stderr, "Run of variant %s failed\n", variants[v]);
+			continue;
+		}
+		printf("%s,%s,%s,%s,%s,%d,%llu,%llu,%llu,%.4f,%.4f,%.1f,%.0f,%llu,%llu,%.1f,%.1f\n",
+				variants[v], producers[p], consumers[c], queues[q], batches[b], rep,
+				r.lines, r.bytes, r.tokens, r.wall_s, r.elapsed_s,
+				r.bytes / r.elapsed_s / 1e6, r.tokens / r.elapsed_s, r.p50_ns, r.p99_ns,
+				r.full_ns / 1e6, r.empty_ns / 1e6);
+		fflush(stdout);
+	}
+
+	for (i=0; i<spec.files; i++)
+		free(files[i]);
+	free(files);
+	free(args);
+	return 0;
+}
+
+void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-G] [-n files] [-s file_size] [-l line_tokens] [-L token_len] "
+			"[-w vocab] [-z zipf] [-S seed] [-d dir] [-x tokenizer] [-p producers,...] "
+			"[-c consumers,...] [-q queue_sizes,...] [-b batch_bytes,...] [-V variants,...] "
+			"[-r runs]\n", name);
+	exit(0);
+}
+
+/*
+ * splits a comma separated list in place, returns how many items
+ */
+int parse_list(char* arg, char* items[]) {
+	int n = 0;
+	char *item, *save;
+	for (item = strtok_r(arg, ",", &save); item != NULL && n < MAX_LIST; item = strtok_r(NULL, ",", &save))
+		items[n++] = item;
+	if (n == 0) {
+		fprintf(stderr, "Empty list\n");
+		exit(1);
+	}
+	return n;
+}
+
+size_t parse_size(const char* arg) {
+	char* end;
+	size_t n = strtoull(arg, &end, 10);
+	switch (*end) {
+	case 'G': case 'g':
+		n *= 1024;
+		/* fall through */
+	case 'M': case 'm':
+		n *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		n *= 1024;
+	}
+	return n;
+}
+
+/*
+ * splitmix64, small and good enough to make up text
+ */
+uint64_t next_random(uint64_t* state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * writes spec->files files of about spec->file_size bytes each into dir.
+ * Tokens are drawn from a vocabulary of made up words with a zipf
+ * distribution, token and line lengths are uniform around their means
+ */
+void make_corpus(const corpus_spec* spec, const char* dir) {
+	uint64_t state = spec->seed;
+	char **words, path[4096], *line;
+	size_t *word_len, written, len, line_cap;
+	double *cdf, sum = 0, u;
+	int f, i, j, n, lo, hi, mid;
+	FILE* fp;
+
+	mkdir(dir, 0777);
+	words = malloc(spec->vocab * sizeof(char*));
+	word_len = malloc(spec->vocab * sizeof(size_t));
+	cdf = malloc(spec->vocab * sizeof(double));
+	for (i=0; i<spec->vocab; i++) {
+		word_len[i] = 1 + next_random(&state) % (2*spec->token_len - 1);
+		words[i] = malloc(word_len[i]);
+		for (j=0; j<(int) word_len[i]; j++)
+			words[i][j] = 'a' + next_random(&state) % 26;
+		sum += 1.0 / pow(i + 1, spec->zipf);
+		cdf[i] = sum;
+	}
+	line_cap = (2*spec->line_tokens) * (2*spec->token_len + 1) + 1;
+	line = malloc(line_cap);
+
+	for (f=0; f<spec->files; f++) {
+		snprintf(path, sizeof(path), "%s/corpus_%03d.txt", dir, f);
+		if ((fp = fopen(path, "w")) == NULL) {
+			perror(path);
+			exit(1);
+		}
+		for (written = 0; written < spec->file_size; written += len) {
+			n = 1 + next_random(&state) % (2*spec->line_tokens - 1);
+			for (i=0, len=0; i<n; i++) {
+				/* pick the first word whose cumulative weight passes u */
+				u = (next_random(&state) >> 11) * 0x1.0p-53 * sum;
+				for (lo=0, hi=spec->vocab-1; lo < hi; ) {
+					mid = (lo + hi) / 2;
+					if (cdf[mid] < u)
+						lo = mid + 1;
+					else
+						hi = mid;
+				}
+				memcpy(line + len, words[lo], word_len[lo]);
+				len += word_len[lo];
+				line[len++] = (i < n - 1) ? ' ' : '\n';
+			}
+			fwrite(line, 1, len, fp);
+		}
+		fclose(fp);
+	}
+
+	for (i=0; i<spec->vocab; i++)
+		free(words[i]);
+	free(words);
+	free(word_len);
+	free(cdf);
+	free(line);
+}
+
+/*
+ * runs the tokenizer with its output thrown away and reads back the
+ * counters it wrote to json. Returns 0 if it didn't exit cleanly
+ */
+int run(char* argv[], const char* json, result* r) {
+	pid_t pid;
+	int status, fd;
+	double start = now();
+
+	unlink(json);
+	if ((pid = fork()) == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return 0;
+	r->wall_s = now() - start;
+	return read_stats(json, r);
+}
+
+/*
+ * pulls the totals and latency quantiles out of the JSON written by -j.
+ * It is always laid out the same way, so looking for the keys is enough
+ */
+int read_stats(const char* json, result* r) {
+	FILE* fp = fopen(json, "r");
+	char* text;
+	long len;
+
+	if (fp == NULL)
+		return 0;
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	text = malloc(len + 1);
+	len = fread(text, 1, len, fp);
+	text[len] = '\0';
+	fclose(fp);
+
+	r->elapsed_s = json_number(text, NULL, "elapsed_ns") / 1e9;
+	r->lines = json_number(text, "\"totals\"", "lines");
+	r->bytes = json_number(text, "\"totals\"", "bytes");
+	r->tokens = json_number(text, "\"totals\"", "tokens");
+	r->full_ns = json_number(text, "\"totals\"", "blocked_full_ns");
+	r->empty_ns = json_number(text, "\"totals\"", "blocked_empty_ns");
+	r->p50_ns = json_number(text, "\"line_latency\"", "p50_ns");
+	r->p99_ns = json_number(text, "\"line_latency\"", "p99_ns");
+	free(text);
+	return r->elapsed_s > 0;
+}
+
+/*
+ * value of the first "key" after the text after, or from the start
+ */
+unsigned long long json_number(const char* text, const char* after, const char* key) {
+	char quoted[64];
+	const char* at = text;
+
+	if (after != NULL && (at = strstr(text, after)) == NULL)
+		return 0;
+	snprintf(quoted, sizeof(quoted), "\"%s\":", key);
+	if ((at = strstr(at, quoted)) == NULL)
+		return 0;
+	return strtoull(at + strlen(quoted), NULL, 10);
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
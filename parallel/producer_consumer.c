@@ -1,238 +1,2497 @@
 /*
  * A program that takes a series of files and tokenizes them.
  * Uses OpenMP to create a producer-consumer method of tokenizing
- * where each file has one producer that puts each line in a shared queue
- * and a pool of consumers that read each line and tokenize it.
+ * where producers hand batches of lines to a queue per consumer and
+ * each consumer tokenizes the lines in its own queue, stealing from the
+ * others when it runs dry.
+ *
+ * Compile:  gcc -O2 -fopenmp producer_consumer.c -o producer_consumer
+ * Usage:    ./producer_consumer [options] <max_queue_size> <file1> ... <fileN>
+ *           a file of - reads stdin
+ *   -p, -c  producer and consumer threads, one per core by default
+ *   -b      bytes of lines per batch
+ *   -d      characters that separate tokens, newline always does
+ *   -o      write tokens in the order they appear in the files
+ *   -a, -k  count each token instead of printing it, -k the top k only
+ *   -s      read through stdio instead of mapping files
+ *   -m      tokenize with table, sse2 or avx2 instead of the best one
+ *   -t      time the tokenizers on the input instead of running
+ *   -j, -i  write counters as JSON, -i adds snapshots every so many ms
+ *   -v      report allocator use on stderr
  */
+#define _GNU_SOURCE /* memrchr */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <omp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
-typedef struct q_node {
-	struct q_node* next;
-	void* data;
-} node;
+#define CACHE_LINE 64
+#define MAX_SPIN 4096 /* most a thread will spin before parking */
+#define MAX_QUEUE (1 << 20) /* most items a queue is made to hold */
+#define DEFAULT_BATCH (64*1024) /* bytes of lines per work item */
+#define MIN_RANGE (1024*1024) /* smallest piece of a file given to a producer */
+#define RANGES_PER_CORE 4 /* extra ranges so producers finish together */
+#define OUT_BUF_SIZE (1024*1024) /* bytes a consumer collects before writing */
+#define ARENA_BLOCK (1024*1024) /* bytes of interned token text per block */
+#define RETURN_BATCH 32 /* pooled buffers sent back to their owner at once */
+#define BATCH_BUF 0 /* pool size class for stdio input buffers */
+#define ORDERED_BUF 1 /* pool size class for ordered output */
+#define POOL_CLASSES 2
+#define DEPTH_BUCKETS 16 /* queue depth histogram, bucket b holds depths below 2^b */
+#define DEPTH_SAMPLE 16 /* hand-offs between queue depth samples */
+#define LATENCY_SUB_BITS 3 /* latency buckets split each power of 2 in 8 */
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
 
+#define MAX_SIMD_DELIMS 16 /* more delimiters than this use the table */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void) 0)
+#endif
+
+/* adds to a counter only its own thread writes, no locked instruction */
+#define STAT_ADD(c, n) atomic_store_explicit(&(c), \
+		atomic_load_explicit(&(c), memory_order_relaxed) + (n), memory_order_relaxed)
+
+/*
+ * a piece of work handed from producers to consumers: len bytes
+ * starting at data, made up of whole lines. owned is set when data
+ * was malloc'd by the producer and has to be freed after tokenizing,
+ * views into a mapped file are not. It is the chunk'th piece of
+ * tasks[task], which puts it in order for -o. queued is when it was
+ * handed off, only set with -j
+ */
+typedef struct work_type {
+	const char* data;
+	size_t len;
+	int owned;
+	int task, chunk;
+	uint64_t queued;
+} work;
+
+/*
+ * one slot of the ring buffer, seq tells whether the slot is
+ * ready to be written (seq == pos) or read (seq == pos+1)
+ */
+typedef struct q_cell {
+	atomic_size_t seq;
+	work item;
+} cell;
+
+/*
+ * a file mapped into memory, kept until all consumers are done with it
+ */
+typedef struct mapping_type {
+	char* addr;
+	size_t len;
+} mapping;
+
+/*
+ * walks a span 64 bytes at a time. starts and ends hold the bits of
+ * the current block where tokens begin and where they stop, token is
+ * the start of a token whose end hasn't been found yet
+ */
+typedef struct scanner_type {
+	const char *block, *end;
+	uint64_t starts, ends;
+	uint64_t carry; /* 1 if the byte before block is a delimiter */
+	const char* token;
+} scanner;
+
+/*
+ * a piece of a file for one producer to read: bytes [lo, hi) of a
+ * mapped file, moved to line boundaries by the producer. path is set
+ * instead for files read through stdio, which are never split and are
+ * only opened once a producer gets to them
+ */
+typedef struct task_type {
+	int file;
+	size_t lo, hi;
+	char* path;
+	atomic_int chunks; /* how many work items it made, -1 until done */
+	uint64_t bytes, read_ns; /* for -j, read_ns leaves out time spent blocked */
+} task;
+
+/*
+ * reads a stream ahead of the producer on its own thread. The producer
+ * asks for buf to be filled from off up to want bytes and picks up the
+ * result later, got stays -1 while the read is in flight. Small regular
+ * files have no thread, finish_read just reads them then and there
+ */
+typedef struct read_ahead_type {
+	int fd, threaded, quit;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char* buf;
+	size_t off, want;
+	ssize_t got;
+} read_ahead;
+
+/*
+ * tokens waiting to be written out
+ */
+typedef struct out_buf_type {
+	char* data;
+	size_t len, cap;
+} out_buf;
+
+/*
+ * output of one work item waiting for its turn in ordered mode
+ */
+typedef struct pending_type {
+	int task, chunk;
+	out_buf out;
+} pending;
+
+/*
+ * one distinct token and how often it was seen. str points into the
+ * owning counter's arena so it outlives the buffer it came from
+ */
+typedef struct count_entry_type {
+	uint64_t hash;
+	const char* str;
+	uint32_t len;
+	uint64_t count;
+} count_entry;
+
+typedef struct arena_block_type {
+	struct arena_block_type* next;
+	size_t used;
+	char data[ARENA_BLOCK];
+} arena_block;
+
+/*
+ * open addressing hash table of token counts with linear probing,
+ * empty slots have a NULL str. Padded since there is one per thread
+ */
+typedef struct counter_type {
+	count_entry* slots;
+	size_t mask, used;
+	arena_block* arena;
+	char pad[CACHE_LINE - sizeof(count_entry*) - 2*sizeof(size_t) - sizeof(arena_block*)];
+} counter;
+
+/*
+ * sits in front of every pooled buffer. owner is the pool it goes back
+ * to, -1 for buffers too big for their class which come straight from
+ * malloc. next links free lists and batches on their way back
+ */
+typedef struct buf_header_type {
+	struct buf_header_type* next;
+	size_t cap;
+	int owner, cls;
+	char pad[8]; /* keeps the data 16 byte aligned */
+} buf_header;
+
+/*
+ * a thread's buffers. free_list is only touched by the owner, other
+ * threads push whole batches onto returned and the owner takes them
+ * all at once when its free list runs dry. batch holds the buffers this
+ * thread is collecting for each other thread and class
+ */
+typedef struct pool_type {
+	buf_header* free_list[POOL_CLASSES];
+	buf_header** batch;
+	buf_header** batch_tail;
+	int* batch_len;
+	long allocs; /* calls into malloc/realloc/free made by this thread */
+	char pad0[CACHE_LINE];
+	_Atomic(buf_header*) returned[POOL_CLASSES];
+	char pad1[CACHE_LINE];
+} pool;
+
+/*
+ * what one thread has done, for -j. Each thread only adds to its own
+ * counters, they are atomic so snapshots can read them during the run.
+ * Aligned so no two threads' counters share a cache line
+ */
+typedef struct stats_type {
+	_Alignas(CACHE_LINE) atomic_ulong lines, bytes, tokens, batches;
+	atomic_ulong full_ns, empty_ns; /* time blocked on a full or empty queue */
+	atomic_ulong depth[DEPTH_BUCKETS]; /* sampled depth of queues handed to */
+	atomic_ulong latency[LATENCY_BUCKETS]; /* lines by time from hand-off to tokenized */
+	unsigned long handoffs;
+} stats;
+
+/*
+ * totals across threads at one point in the run
+ */
+typedef struct snapshot_type {
+	uint64_t time_ns;
+	uint64_t lines, bytes, tokens, full_ns, empty_ns;
+	int depth, tasks_done;
+} snapshot;
+
+/*
+ * where threads park when the queue is full (producers) or empty
+ * (consumers). waiting is checked without the lock so the common case
+ * of nobody parked never touches the mutex. spin is how long a thread
+ * spins before parking, it grows when spinning pays off and shrinks
+ * when it doesn't
+ */
+typedef struct waiter_type {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	atomic_int waiting;
+	atomic_int spin;
+	char pad[CACHE_LINE];
+} waiter;
+
+/*
+ * bounded lock-free multi-producer/multi-consumer queue.
+ * head and tail live on their own cache lines so producers and
+ * consumers don't fight over the same line
+ */
 typedef struct queue_type {
-	node head;
-	node tail;
-	int enqueued;
-	int dequeued;
+	cell* buffer;
+	size_t mask;
+	char pad0[CACHE_LINE - sizeof(cell*) - sizeof(size_t)];
+	atomic_size_t tail; /* next position to enqueue */
+	char pad1[CACHE_LINE - sizeof(atomic_size_t)];
+	atomic_size_t head; /* next position to dequeue */
+	char pad2[CACHE_LINE - sizeof(atomic_size_t)];
+	waiter not_full;
+	waiter not_empty;
 } queue;
 
-void init_queue(queue** q);
+/*
+ * puts the output of work items back in order. task and chunk are
+ * the next ones due, anything that finishes early waits in held,
+ * a min-heap on (task, chunk). in_flight counts items handed off but
+ * not written yet, producers park on room while it is over window so
+ * held can't grow without bound
+ */
+typedef struct reorder_type {
+	pthread_mutex_t lock;
+	atomic_int task;
+	int chunk;
+	pending* held;
+	int num_held, cap;
+	atomic_int in_flight;
+	int window;
+	waiter room;
+} reorder;
+
+void init_queue(queue** q, int capacity);
 
 void destroy_queue(queue** q);
 
-int enqueue(queue* q, void* line);
+int enqueue(queue* q, const work* item);
 
-void* dequeue(queue* q);
-
-void dequeue_helper(queue* q, void** ret_value);
+int dequeue(queue* q, work* item);
 
 int size(queue* q);
 
-void produce(char* file, int max_queue_size);
+void put(queue* q, const work* item);
 
-void consume();
+int take(int id, work* item);
 
-int done();
+int steal(int id, work* item);
+
+void init_waiter(waiter* w);
+
+void destroy_waiter(waiter* w);
+
+void wake(waiter* w, int all);
+
+void make_tasks(char* files[]);
+
+void produce();
+
+void hand_off(const work* item, int* next);
+
+void wait_for_window(const work* item);
+
+int produce_range(int t, int* next);
 
-void print_queue(queue* q);
+size_t line_start(mapping* map, size_t pos);
 
-int thread_count, finished, num_files;
-queue* lines;
+int produce_stream(int fd, int t, int* next);
+
+void init_read_ahead(read_ahead* ra, int fd);
+
+void stop_read_ahead(read_ahead* ra);
+
+void* read_ahead_thread(void* arg);
+
+void start_read(read_ahead* ra, char* buf, size_t off, size_t want);
+
+ssize_t finish_read(read_ahead* ra);
+
+ssize_t read_full(int fd, char* buf, size_t len);
+
+int open_input(const char* path);
+
+void consume(int id);
+
+void init_delims(const char* del);
+
+void init_scanner(scanner* sc, const char* data, size_t len);
+
+const char* next_token(scanner* sc, size_t* len);
+
+void scan_block(scanner* sc);
+
+uint64_t delim_mask_table(const char* block);
+
+#ifdef HAVE_X86_SIMD
+uint64_t delim_mask_sse2(const char* block);
+
+uint64_t delim_mask_avx2(const char* block);
+#endif
+
+void bench_tokenizer();
+
+int check_scanner(const char* name);
+
+char* read_input(const char* path, size_t* len);
+
+void init_out(out_buf* out, size_t cap);
+
+void out_token(out_buf* out, const char* prefix, size_t prefix_len, const char* token, size_t len);
+
+void flush_out(out_buf* out);
+
+void write_all(const char* data, size_t len);
+
+void submit_ordered(const work* item, out_buf* out);
+
+void drain_ordered();
+
+int pending_before(const pending* a, const pending* b);
+
+uint64_t hash_token(const char* token, size_t len);
+
+void init_counter(counter* c, size_t cap);
+
+void free_counter(counter* c);
+
+void count_token(counter* c, uint64_t hash, const char* token, size_t len, uint64_t n, int intern_it);
+
+const char* intern(counter* c, const char* token, size_t len);
+
+void merge_counts();
+
+void report_counts(counter* c, out_buf* out);
+
+int entry_before(const count_entry* a, const count_entry* b);
+
+void top_push(count_entry* heap, int* n, const count_entry* e);
+
+int compare_entries(const void* a, const void* b);
+
+void init_pools(int n);
+
+void destroy_pools();
+
+char* pool_get(int cls, size_t need);
+
+void pool_put(char* data);
+
+char* pool_grow(char* data, size_t len, size_t need);
+
+size_t pool_cap(char* data);
+
+void* counted_malloc(size_t size);
+
+void* counted_realloc(void* ptr, size_t size);
+
+void counted_free(void* ptr);
+
+uint64_t now_ns();
+
+void add_wait(int full, uint64_t start);
+
+void sample_depth(queue* q);
+
+void count_batch(const work* item, uint64_t tokens);
+
+int latency_bucket(uint64_t ns);
+
+uint64_t bucket_floor(int b);
+
+void force_delim_mask(const char* name);
+
+void take_snapshot(snapshot* snap);
+
+void* snapshot_thread(void* arg);
+
+void write_stats(const char* path, uint64_t elapsed_ns);
+
+void write_json_string(FILE* fp, const char* str);
+
+int done();
+
+int thread_count, num_files, num_producers, num_consumers, num_tasks, use_mmap = 1, ordered = 0;
+int aggregate = 0, top_k = 0, verbose = 0;
+size_t batch_size = DEFAULT_BATCH;
+atomic_int finished, next_task;
+queue** lines; /* one per consumer */
+mapping* maps;
+task* tasks;
+char** file_names;
+char delims[256]; /* nonzero for bytes that separate tokens */
+char delim_list[MAX_SIMD_DELIMS];
+int num_delims;
+/* bitmask of the delimiters in a 64 byte block, picked for the cpu */
+uint64_t (*delim_mask)(const char* block);
+pthread_mutex_t out_lock; /* keeps whole buffers together on stdout */
+reorder order;
+counter* counts; /* one per thread when aggregating */
+pool* pools; /* one per thread */
+size_t class_cap[POOL_CLASSES];
+stats* thread_stats; /* one per thread with -j, NULL otherwise */
+uint64_t run_start;
+snapshot* snapshots;
+int num_snapshots, snapshot_cap;
+long snapshot_ms;
+atomic_int stop_snapshots;
+pthread_mutex_t snapshot_lock;
+pthread_cond_t snapshot_cond;
 
 int main(int argc, char* argv[]) {
-	int max_queue_size;
+	int max_queue_size, opt, i, first_file, bench = 0;
+	long queue_arg;
+	char* end;
+	const char* del = " ";
+	const char* stats_path = NULL;
+	const char* mask_name = NULL;
+	pthread_t snapshotter;
+	
+	num_producers = num_consumers = 0;
+	while ((opt = getopt(argc, argv, "ab:c:d:i:j:k:m:op:stv")) != -1) {
+		switch (opt) {
+		case 'j': /* write counters for the run to this file as JSON */
+			stats_path = optarg;
+			break;
+		case 'i': /* with -j, also snapshot the totals every this many ms */
+			snapshot_ms = strtol(optarg, NULL, 10);
+			break;
+		case 'm': /* tokenize with table, sse2 or avx2 instead of the best one */
+			mask_name = optarg;
+			break;
+		case 'v': /* report allocator use on stderr */
+			verbose = 1;
+			break;
+		case 'a': /* print how often each token appears */
+			aggregate = 1;
+			break;
+		case 'k': /* print only the k most common tokens */
+			aggregate = 1;
+			top_k = strtol(optarg, NULL, 10);
+			break;
+		case 'o': /* write tokens in the order they appear in the files */
+			ordered = 1;
+			break;
+		case 'd': /* characters that separate tokens, newline always does */
+			del = optarg;
+			break;
+		case 't': /* time the tokenizers on the input instead of running */
+			bench = 1;
+			break;
+		case 'c': /* number of consumer threads */
+			num_consumers = strtol(optarg, NULL, 10);
+			break;
+		case 'p': /* number of producer threads */
+			num_producers = strtol(optarg, NULL, 10);
+			break;
+		case 'b': /* bytes per work item, 1 hands over single lines */
+			batch_size = strtoul(optarg, NULL, 10);
+			if (batch_size < 1)
+				batch_size = 1;
+			break;
+		case 's': /* read through stdio instead of mapping files */
+			use_mmap = 0;
+			break;
+		default:
+			exit(0);
+		}
+	}
 	/* check if at least 1 file specified */
-	if (argc < 3) {
-		printf("Usage: %s <max_queue_size> <file1> <file2> ... <fileN>\n", argv[0]);
+	if (argc - optind < 2) {
+		printf("Usage: %s [-aostv] [-k top] [-b batch_bytes] [-p producers] [-c consumers] [-d delimiters] [-m table|sse2|avx2] [-j stats.json [-i snapshot_ms]] <max_queue_size> <file1> <file2> ... <fileN>\n", argv[0]);
+		exit(0);
+	}
+	queue_arg = strtol(argv[optind], &end, 10);
+	if (end == argv[optind] || *end != '\0' || queue_arg < 1) {
+		fprintf(stderr, "max_queue_size should be a number of at least 1, not \"%s\"\n", argv[optind]);
+		exit(1);
+	}
+	max_queue_size = (queue_arg > MAX_QUEUE) ? MAX_QUEUE : queue_arg;
+	first_file = optind + 1;
+	num_files = argc - first_file;
+	atomic_init(&finished, 0);
+	atomic_init(&next_task, 0);
+	init_delims(del);
+	if (mask_name != NULL)
+		force_delim_mask(mask_name);
+	make_tasks(&argv[first_file]);
+	if (bench) {
+		bench_tokenizer();
 		exit(0);
 	}
-	max_queue_size = strtol(argv[1], NULL, 10);
-	num_files = argc - 2;
-	finished = 0;
 	
-	/* has roughly half as many consumers as producers */
-	thread_count = num_files + (num_files/2) + 1;
-	init_queue(&lines);
+	/* both default to one per core, more producers than tasks would
+	   just sit idle */
+	if (num_producers < 1)
+		num_producers = omp_get_num_procs();
+	if (num_producers > num_tasks)
+		num_producers = num_tasks;
+	if (num_consumers < 1)
+		num_consumers = omp_get_num_procs();
+	thread_count = num_producers + num_consumers;
+	
+	/* max_queue_size is shared out between the consumers' queues */
+	lines = malloc(num_consumers * sizeof(queue*));
+	for (i=0; i<num_consumers; i++)
+		init_queue(&lines[i], max_queue_size / num_consumers);
+	pthread_mutex_init(&out_lock, NULL);
+	pthread_mutex_init(&order.lock, NULL);
+	atomic_init(&order.task, 0);
+	order.chunk = 0;
+	order.num_held = order.cap = 0;
+	order.held = NULL;
+	/* room for a full set of queues plus a few batches per consumer */
+	atomic_init(&order.in_flight, 0);
+	order.window = max_queue_size + 4*num_consumers;
+	init_waiter(&order.room);
+	init_pools(thread_count);
+	if (aggregate) {
+		ordered = 0;
+		counts = aligned_alloc(CACHE_LINE, thread_count * sizeof(counter));
+		for (i=0; i<thread_count; i++)
+			init_counter(&counts[i], 1024);
+	}
+	if (stats_path != NULL) {
+		thread_stats = aligned_alloc(CACHE_LINE, thread_count * sizeof(stats));
+		memset(thread_stats, 0, thread_count * sizeof(stats));
+	}
+	run_start = now_ns();
+	if (stats_path != NULL && snapshot_ms > 0) {
+		atomic_init(&stop_snapshots, 0);
+		pthread_mutex_init(&snapshot_lock, NULL);
+		pthread_cond_init(&snapshot_cond, NULL);
+		pthread_create(&snapshotter, NULL, snapshot_thread, NULL);
+	}
 	
 #	pragma omp parallel num_threads(thread_count)
 	{
 		int rank = omp_get_thread_num();
-		/* first num_files ranks are producers */
-		if (rank < num_files)
-			produce(argv[2 + rank], max_queue_size);
+		/* first num_producers ranks are producers */
+		if (rank < num_producers)
+			produce();
 		else
-			consume();
+			consume(rank - num_producers);
 	}
 	
-	destroy_queue(&lines);
+	/* every task has published its chunk count by now, so whatever was
+	   held back can go out */
+	if (ordered)
+		drain_ordered();
+	if (aggregate) {
+		merge_counts();
+		for (i=0; i<thread_count; i++)
+			free_counter(&counts[i]);
+		free(counts);
+	}
+	if (stats_path != NULL && snapshot_ms > 0) {
+		pthread_mutex_lock(&snapshot_lock);
+		atomic_store(&stop_snapshots, 1);
+		pthread_cond_signal(&snapshot_cond);
+		pthread_mutex_unlock(&snapshot_lock);
+		pthread_join(snapshotter, NULL);
+		pthread_mutex_destroy(&snapshot_lock);
+		pthread_cond_destroy(&snapshot_cond);
+	}
+	/* before the pools go, they hold the allocator counts */
+	if (stats_path != NULL) {
+		write_stats(stats_path, now_ns() - run_start);
+		free(thread_stats);
+		free(snapshots);
+	}
+	free(order.held);
+	pthread_mutex_destroy(&order.lock);
+	destroy_waiter(&order.room);
+	pthread_mutex_destroy(&out_lock);
+	for (i=0; i<num_consumers; i++)
+		destroy_queue(&lines[i]);
+	free(lines);
+	destroy_pools();
+	free(tasks);
+	/* consumers are done with every view, safe to unmap now */
+	for (i=0; i<num_files; i++) {
+		if (maps[i].addr != NULL)
+			munmap(maps[i].addr, maps[i].len);
+	}
+	free(maps);
 	return 0;
 }
 
 /*
- * initializes a queue
+ * initializes a queue that can hold at least capacity items, up to
+ * MAX_QUEUE, the ring is rounded up to a power of 2 so positions can
+ * be masked
  */
-void init_queue(queue** q) {
-	*q = malloc(sizeof(queue));
-	((*q)->head).next = &((*q)->tail);
-	((*q)->head).data = NULL;
-	((*q)->tail).next = &((*q)->head);
-	((*q)->tail).data = NULL;
-	(*q)->enqueued = 0;
-	(*q)->dequeued = 0;
+void init_queue(queue** q, int capacity) {
+	size_t n = 2, i;
+	if (capacity > MAX_QUEUE)
+		capacity = MAX_QUEUE;
+	while (n < (size_t) capacity)
+		n <<= 1;
+	*q = aligned_alloc(CACHE_LINE, sizeof(queue));
+	(*q)->buffer = aligned_alloc(CACHE_LINE, n*sizeof(cell));
+	if ((*q)->buffer == NULL) {
+		perror("queue");
+		exit(1);
+	}
+	(*q)->mask = n - 1;
+	for (i=0; i<n; i++) {
+		atomic_init(&((*q)->buffer[i].seq), i);
+	}
+	atomic_init(&(*q)->tail, 0);
+	atomic_init(&(*q)->head, 0);
+	init_waiter(&(*q)->not_full);
+	init_waiter(&(*q)->not_empty);
 }
 
 /*
- * destroys the queue, making sure to deallocate all nodes
+ * destroys the queue, making sure to deallocate anything left in it
  */
 void destroy_queue(queue** q) {
-	while (size(*q) > 0)
-		free(dequeue(*q));
+	work item;
+	while (dequeue(*q, &item)) {
+		if (item.owned)
+			pool_put((char*) item.data);
+	}
+	destroy_waiter(&(*q)->not_full);
+	destroy_waiter(&(*q)->not_empty);
+	free((*q)->buffer);
 	free(*q);
 }
 
 /*
- * Adds a new node containing the string line at the end of queue q
- * returns -1 in case of some error
+ * Adds item at the end of queue q
+ * returns 0 if the queue is full, 1 otherwise
  */
-int enqueue(queue* q, void* data) {
-	node* new_node = malloc(sizeof(node));
-	node* last_node = (q->tail).next;
-	last_node->next = new_node;
-	(q->tail).next = new_node;
-	new_node->data = data;
-	new_node->next = &(q->tail);
-	(q->enqueued)++;
+int enqueue(queue* q, const work* item) {
+	cell* c;
+	size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	for (;;) {
+		c = &q->buffer[pos & q->mask];
+		size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+		long diff = (long) seq - (long) pos;
+		if (diff == 0) {
+			/* slot is free, try to claim it */
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+			return 0; /* slot still holds an item from last lap, full */
+		else
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	}
+	c->item = *item;
+	atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
 	return 1;
 }
 
 /*
- * Returns the item at the front of the queue
- * this method takes care of the critical sections
+ * Copies the item at the front of the queue into item
+ * returns 0 if the queue is empty, 1 otherwise
  */
-void* dequeue(queue* q) {
-	void* ret_val = NULL;
-	int q_size = size(q);
-	if (q_size < 2) 
-#	pragma omp critical(enqueue)
-	{
-		dequeue_helper(q, &ret_val);
-		if (size(q) == 0) 
-			(q->tail).next = &(q->head);
+int dequeue(queue* q, work* item) {
+	cell* c;
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	for (;;) {
+		c = &q->buffer[pos & q->mask];
+		size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+		long diff = (long) seq - (long) (pos + 1);
+		if (diff == 0) {
+			/* slot has been written, try to claim it */
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+			return 0; /* nothing written here yet, empty */
+		else
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
 	}
-	else
-		dequeue_helper(q, &ret_val);
-		
-	return ret_val;
+	*item = c->item;
+	/* hand the slot back to producers for the next lap */
+	atomic_store_explicit(&c->seq, pos + q->mask + 1, memory_order_release);
+	return 1;
 }
 
 /*
- * helper method for the dequeue method, does the actual dequeuing 
+ * Returns size of the queue, only a snapshot while other threads are
+ * using it
  */
-void dequeue_helper(queue* q, void** ret_value) {
-	/* empty queue */
-	if ((q->head).next == &(q->tail) || size(q) == 0) {
-		*ret_value = NULL;
-		return;
+int size(queue* q) {
+	size_t tail = atomic_load(&q->tail);
+	size_t head = atomic_load(&q->head);
+	return (tail > head) ? (int) (tail - head) : 0;
+}
+
+/*
+ * Adds item to the queue, blocking while it is full.
+ * Spins for a little while first since a consumer usually frees a
+ * slot quickly, then parks on not_full
+ */
+void put(queue* q, const work* item) {
+	int i, spin = atomic_load_explicit(&q->not_full.spin, memory_order_relaxed);
+	/* hand_off only calls this once every queue was full */
+	uint64_t start = (thread_stats != NULL) ? now_ns() : 0;
+	
+	for (i=0; i<spin; i++) {
+		if (enqueue(q, item)) {
+			if (spin < MAX_SPIN)
+				atomic_store_explicit(&q->not_full.spin, spin*2, memory_order_relaxed);
+			wake(&q->not_empty, 0);
+			add_wait(1, start);
+			return;
+		}
+		cpu_relax();
 	}
+	if (spin > 1)
+		atomic_store_explicit(&q->not_full.spin, spin/2, memory_order_relaxed);
 	
-	node* n = (q->head).next;
-	(q->head).next = n->next;
-	*ret_value = n->data;
-	free(n);
-	(q->dequeued)++;
+	while (!enqueue(q, item)) {
+		pthread_mutex_lock(&q->not_full.lock);
+		atomic_fetch_add(&q->not_full.waiting, 1);
+		/* recheck after announcing ourselves so a wake can't be missed */
+		while (size(q) > (int) q->mask)
+			pthread_cond_wait(&q->not_full.cond, &q->not_full.lock);
+		atomic_fetch_sub(&q->not_full.waiting, 1);
+		pthread_mutex_unlock(&q->not_full.lock);
+	}
+	wake(&q->not_empty, 0);
+	add_wait(1, start);
 }
 
 /*
- * Returns size of the queue
+ * Takes an item for consumer id, blocking while there is nothing to do.
+ * Tries its own queue first, then steals from the others. Only parks
+ * on its own queue, producers deal to every queue in turn so each one
+ * gets work soon.
+ * Returns 0 once all producers are done and every queue is drained
  */
-int size(queue* q) {
-	return (q->enqueued) - (q->dequeued);
+int take(int id, work* item) {
+	queue* q = lines[id];
+	int i, spin = atomic_load_explicit(&q->not_empty.spin, memory_order_relaxed);
+	uint64_t start = 0; /* set once the first try comes up empty */
+	
+	for (i=0; i<spin; i++) {
+		if (dequeue(q, item)) {
+			if (spin < MAX_SPIN)
+				atomic_store_explicit(&q->not_empty.spin, spin*2, memory_order_relaxed);
+			wake(&q->not_full, 0);
+			add_wait(0, start);
+			return 1;
+		}
+		if (steal(id, item)) {
+			add_wait(0, start);
+			return 1;
+		}
+		if (done()) {
+			add_wait(0, start);
+			return 0;
+		}
+		if (start == 0 && thread_stats != NULL)
+			start = now_ns();
+		cpu_relax();
+	}
+	if (spin > 1)
+		atomic_store_explicit(&q->not_empty.spin, spin/2, memory_order_relaxed);
+	
+	for (;;) {
+		if (dequeue(q, item)) {
+			wake(&q->not_full, 0);
+			add_wait(0, start);
+			return 1;
+		}
+		if (steal(id, item)) {
+			add_wait(0, start);
+			return 1;
+		}
+		if (done()) {
+			add_wait(0, start);
+			return 0;
+		}
+		pthread_mutex_lock(&q->not_empty.lock);
+		atomic_fetch_add(&q->not_empty.waiting, 1);
+		while (size(q) == 0 && atomic_load(&finished) < num_producers)
+			pthread_cond_wait(&q->not_empty.cond, &q->not_empty.lock);
+		atomic_fetch_sub(&q->not_empty.waiting, 1);
+		pthread_mutex_unlock(&q->not_empty.lock);
+	}
+}
+
+/*
+ * takes an item from any queue other than consumer id's own,
+ * returns 0 if they are all empty. id of -1 looks at every queue
+ */
+int steal(int id, work* item) {
+	int i, victim;
+	for (i=1; i<=num_consumers; i++) {
+		victim = (id + i) % num_consumers;
+		if (victim == id)
+			continue;
+		if (dequeue(lines[victim], item)) {
+			wake(&lines[victim]->not_full, 0);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void init_waiter(waiter* w) {
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	atomic_init(&w->waiting, 0);
+	atomic_init(&w->spin, 64);
+}
+
+void destroy_waiter(waiter* w) {
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+}
+
+/*
+ * wakes one (or all) threads parked on w. The fence pairs with the
+ * increment of waiting in put/take: either we see the waiter or it
+ * sees the queue change we just made
+ */
+void wake(waiter* w, int all) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&w->waiting, memory_order_relaxed) == 0)
+		return;
+	pthread_mutex_lock(&w->lock);
+	if (all)
+		pthread_cond_broadcast(&w->cond);
+	else
+		pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
 }
 
 /*
- * runs the producer thread, adding lines to the queue and reading them
- * from file
+ * opens every file and splits it into tasks for the producers.
+ * Regular files are mapped and cut into ranges sized so that there are
+ * a few ranges per core, anything else becomes a single stdio task
  */
- void produce(char* file, int max_queue_size) {
-	FILE* fp;
-	char* line = malloc(255*sizeof(char));
+void make_tasks(char* files[]) {
+	int i, fd;
+	size_t total = 0, range, lo;
+	struct stat st;
+	char* streamed = calloc(num_files, 1);
 	
-	fp = fopen(file, "r");
-	if (fp == NULL) {
-		printf("Could not open file: \"%s\"\n", file);
-		exit(0);
+	file_names = files;
+	maps = calloc(num_files, sizeof(mapping));
+	for (i=0; i<num_files; i++) {
+		fd = open_input(files[i]);
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			printf("Could not open file: \"%s\"\n", files[i]);
+			exit(0);
+		}
+		if (use_mmap && S_ISREG(st.st_mode) && st.st_size > 0) {
+			maps[i].addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (maps[i].addr == MAP_FAILED) {
+				perror("mmap");
+				exit(1);
+			}
+			madvise(maps[i].addr, st.st_size, MADV_SEQUENTIAL);
+			maps[i].len = st.st_size;
+			total += st.st_size;
+		}
+		else {
+			/* empty regular files have nothing to read */
+			streamed[i] = !(use_mmap && S_ISREG(st.st_mode));
+		}
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+	
+	range = total / (omp_get_num_procs() * RANGES_PER_CORE);
+	if (range < MIN_RANGE)
+		range = MIN_RANGE;
+	if (range < batch_size)
+		range = batch_size;
+	
+	num_tasks = 0;
+	for (i=0; i<num_files; i++)
+		num_tasks += (maps[i].addr != NULL) ? (maps[i].len + range - 1) / range : (size_t) streamed[i];
+	tasks = malloc(num_tasks * sizeof(task));
+	
+	num_tasks = 0;
+	for (i=0; i<num_files; i++) {
+		if (maps[i].addr != NULL) {
+			for (lo=0; lo<maps[i].len; lo+=range) {
+				tasks[num_tasks].file = i;
+				tasks[num_tasks].lo = lo;
+				tasks[num_tasks].hi = (maps[i].len - lo > range) ? lo + range : maps[i].len;
+				tasks[num_tasks].path = NULL;
+				atomic_init(&tasks[num_tasks].chunks, -1);
+				num_tasks++;
+			}
+		}
+		else if (streamed[i]) {
+			tasks[num_tasks].file = i;
+			tasks[num_tasks].lo = tasks[num_tasks].hi = 0;
+			tasks[num_tasks].path = files[i];
+			atomic_init(&tasks[num_tasks].chunks, -1);
+			num_tasks++;
+		}
 	}
+	free(streamed);
+}
+
+/*
+ * runs the producer thread, taking tasks until there are none left
+ * and adding their lines to the queue
+ */
+ void produce() {
+	int t, fd, chunks, next = omp_get_thread_num() % num_consumers;
+	stats* s = (thread_stats != NULL) ? &thread_stats[omp_get_thread_num()] : NULL;
+	uint64_t start = 0, blocked = 0;
 	
-	/* goes through file line by line */
-	while (fgets(line, 255, fp) != NULL) {
-		/* wait until queue has room */
-#		pragma omp critical(enqueue)
-		{
-			while (!(size(lines) <= max_queue_size));
-			enqueue(lines, line);
+	while ((t = atomic_fetch_add(&next_task, 1)) < num_tasks) {
+		tasks[t].bytes = 0;
+		if (s != NULL) {
+			start = now_ns();
+			blocked = atomic_load_explicit(&s->full_ns, memory_order_relaxed);
+		}
+		if (tasks[t].path != NULL) {
+			fd = open_input(tasks[t].path);
+			if (fd == -1) {
+				printf("Could not open file: \"%s\"\n", tasks[t].path);
+				exit(0);
+			}
+			chunks = produce_stream(fd, t, &next);
+			if (fd != STDIN_FILENO)
+				close(fd);
+		}
+		else
+			chunks = produce_range(t, &next);
+		if (s != NULL)
+			tasks[t].read_ns = now_ns() - start
+				- (atomic_load_explicit(&s->full_ns, memory_order_relaxed) - blocked);
+		atomic_store(&tasks[t].chunks, chunks);
+		/* the last chunk may have been written before the count was
+		   known, nothing else would move order on to the next task */
+		if (ordered) {
+			pthread_mutex_lock(&order.lock);
+			drain_ordered();
+			pthread_mutex_unlock(&order.lock);
 		}
-		line = malloc(255*sizeof(char));
 	}
 	
-	free(line);
-	fclose(fp);
-	/* update finished counter */
-#	pragma omp atomic
-	finished++;
+	/* update finished counter, the last producer wakes any idle
+	   consumers so they can see that everything is done */
+	if (atomic_fetch_add(&finished, 1) == num_producers - 1) {
+		for (t=0; t<num_consumers; t++)
+			wake(&lines[t]->not_empty, 1);
+	}
 	
-	/* finished producing, may as well try to consume */
-	consume();
+	/* finished producing, may as well help the consumers */
+	consume(-1);
  }
  
  /*
-  * runs the consumer thread, getting lines from the queue 
+  * deals item to the consumers' queues round-robin, next is the
+  * producer's position in the rotation. Skips over full queues and
+  * only blocks if every queue is full
   */
- void consume() {
-	char *saveptr, *token, *line, *str_ptr;
-	char* del = " \n";
-	int rank = omp_get_thread_num();
-	//if (rank<1000) return;
-	while (!done()) {
-		line = NULL;
-#		pragma omp critical(dequeue)
-		{
-			while (size(lines) == 0 && !done());
-			line = dequeue(lines);
+ void hand_off(const work* item, int* next) {
+	int i, target;
+	work stamped;
+	
+	if (thread_stats != NULL) {
+		stamped = *item;
+		stamped.queued = now_ns();
+		item = &stamped;
+	}
+	if (ordered)
+		wait_for_window(item);
+	for (i=0; i<num_consumers; i++) {
+		target = (*next + i) % num_consumers;
+		if (enqueue(lines[target], item)) {
+			wake(&lines[target]->not_empty, 0);
+			if (thread_stats != NULL)
+				sample_depth(lines[target]);
+			*next = (target + 1) % num_consumers;
+			return;
 		}
-		
-		if (line != NULL) {
-			str_ptr = line;
-			/* tokenize line */
-			token = strtok_r(line, del, &saveptr);
-			while (token != NULL) {
-				printf("%d: %s\n", rank, token);
-				token = strtok_r(NULL, del, &saveptr);
+	}
+	/* waits until queue has room */
+	put(lines[*next], item);
+	if (thread_stats != NULL)
+		sample_depth(lines[*next]);
+	*next = (*next + 1) % num_consumers;
+ }
+ 
+ /*
+  * in ordered mode, holds a producer back while too much output is
+  * waiting to be written. Items of the task being written never wait,
+  * they are what lets the writing move on
+  */
+ void wait_for_window(const work* item) {
+	uint64_t start;
+	
+	atomic_fetch_add(&order.in_flight, 1);
+	if (atomic_load(&order.in_flight) <= order.window || item->task <= atomic_load(&order.task))
+		return;
+	start = (thread_stats != NULL) ? now_ns() : 0;
+	pthread_mutex_lock(&order.room.lock);
+	atomic_fetch_add(&order.room.waiting, 1);
+	while (atomic_load(&order.in_flight) > order.window && item->task > atomic_load(&order.task))
+		pthread_cond_wait(&order.room.cond, &order.room.lock);
+	atomic_fetch_sub(&order.room.waiting, 1);
+	pthread_mutex_unlock(&order.room.lock);
+	add_wait(1, start);
+ }
+ 
+ /*
+  * queues the lines that start in [lo, hi) of task t's mapped file as
+  * views of batch_size bytes each, extended to the end of the line they
+  * stop in. No copying. Returns how many work items it made
+  */
+ int produce_range(int t, int* next) {
+	mapping* map = &maps[tasks[t].file];
+	char *start, *cut, *end, *nl;
+	work item;
+	
+	item.owned = 0;
+	item.task = t;
+	item.chunk = 0;
+	start = map->addr + line_start(map, tasks[t].lo);
+	end = map->addr + line_start(map, tasks[t].hi);
+	for (; start < end; start = nl + 1) {
+		cut = ((size_t) (end - start) > batch_size) ? start + batch_size - 1 : end - 1;
+		nl = memchr(cut, '\n', end - cut);
+		if (nl == NULL)
+			nl = end - 1;
+		item.data = start;
+		item.len = nl + 1 - start;
+		tasks[t].bytes += item.len;
+		hand_off(&item, next);
+		item.chunk++;
+	}
+	return item.chunk;
+ }
+ 
+ /*
+  * returns the offset of the first line that starts at or after pos.
+  * Neighbouring ranges agree on their shared boundary, so every line
+  * is read by exactly one producer
+  */
+ size_t line_start(mapping* map, size_t pos) {
+	char* nl;
+	if (pos == 0 || pos >= map->len)
+		return (pos == 0) ? 0 : map->len;
+	nl = memchr(map->addr + pos - 1, '\n', map->len - pos + 1);
+	return (nl == NULL) ? map->len : (size_t) (nl + 1 - map->addr);
+ }
+ 
+ /*
+  * reads anything that can't be mapped. Fills buffers of batch_size
+  * bytes and hands over everything up to the last newline, the partial
+  * line at the end is carried into the next buffer. The next buffer is
+  * already being read while this one is handed off, which is where a
+  * producer blocks when the consumers are behind.
+  * Each buffer is freed by the consumer that tokenizes it.
+  * Returns how many work items it made
+  */
+ int produce_stream(int fd, int t, int* next) {
+	char *buf, *fresh, *nl;
+	size_t want, len = 0, carry;
+	ssize_t got;
+	read_ahead ra;
+	work item;
+	
+	item.owned = 1;
+	item.task = t;
+	item.chunk = 0;
+	init_read_ahead(&ra, fd);
+	/* want is how much to fill, the pooled buffer may be bigger */
+	want = batch_size;
+	buf = pool_get(BATCH_BUF, want);
+	start_read(&ra, buf, 0, want);
+	for (;;) {
+		if ((got = finish_read(&ra)) < 0) {
+			perror(tasks[t].path);
+			exit(1);
+		}
+		len += got;
+		if (got == 0) {
+			/* end of file, whatever is left is the last line */
+			if (len > 0) {
+				item.data = buf;
+				item.len = len;
+				tasks[t].bytes += len;
+				hand_off(&item, next);
+				item.chunk++;
+			}
+			else
+				pool_put(buf);
+			break;
+		}
+		nl = memrchr(buf, '\n', len);
+		if (nl == NULL) {
+			/* one line longer than the buffer, grow it and keep reading */
+			if (len == want) {
+				want *= 2;
+				if (want > pool_cap(buf))
+					buf = pool_grow(buf, len, want);
 			}
-			free(str_ptr);
+			start_read(&ra, buf, len, want);
+			continue;
 		}
+		carry = buf + len - (nl + 1);
+		item.data = buf;
+		item.len = len - carry;
+		want = (carry < batch_size) ? batch_size : carry*2;
+		fresh = pool_get(BATCH_BUF, want);
+		memcpy(fresh, nl + 1, carry);
+		len = carry;
+		start_read(&ra, fresh, carry, want);
+		tasks[t].bytes += item.len;
+		hand_off(&item, next);
+		item.chunk++;
+		buf = fresh;
 	}
+	stop_read_ahead(&ra);
+	return item.chunk;
  }
  
  /*
-  * determines if all producers are done
-  *	finished is incremented once for each file
+  * starts an I/O thread for fd unless it is a regular file small
+  * enough that there is nothing to overlap
   */
- int done() {
-	return (finished == num_files) && (size(lines) == 0);
+ void init_read_ahead(read_ahead* ra, int fd) {
+	struct stat st;
+	
+	ra->fd = fd;
+	ra->quit = 0;
+	ra->buf = NULL;
+	ra->got = 0;
+	ra->threaded = !(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& (size_t) st.st_size <= 2*batch_size);
+	if (!ra->threaded)
+		return;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	if (pthread_create(&ra->thread, NULL, read_ahead_thread, ra) != 0) {
+		pthread_mutex_destroy(&ra->lock);
+		pthread_cond_destroy(&ra->cond);
+		ra->threaded = 0;
+	}
+ }
+ 
+ void stop_read_ahead(read_ahead* ra) {
+	if (!ra->threaded)
+		return;
+	pthread_mutex_lock(&ra->lock);
+	ra->quit = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->thread, NULL);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+ }
+ 
+ /*
+  * waits for a buffer to fill and fills it, until told to quit
+  */
+ void* read_ahead_thread(void* arg) {
+	read_ahead* ra = arg;
+	ssize_t got;
+	
+	pthread_mutex_lock(&ra->lock);
+	for (;;) {
+		while (!ra->quit && (ra->buf == NULL || ra->got != -1))
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->quit)
+			break;
+		pthread_mutex_unlock(&ra->lock);
+		got = read_full(ra->fd, ra->buf + ra->off, ra->want - ra->off);
+		pthread_mutex_lock(&ra->lock);
+		ra->got = got;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
  }
  
- void print_queue(queue* q) {
-	printf("(%p)HEAD\n->", &(q->head));
-	node* n = (q->head).next;
-	while (n != &(q->tail)) {
-		printf("(%p)%s -> ", n, (char *) (n->data));
-		n = n->next;
+ /*
+  * asks for buf to be filled from off up to want bytes
+  */
+ void start_read(read_ahead* ra, char* buf, size_t off, size_t want) {
+	if (ra->threaded)
+		pthread_mutex_lock(&ra->lock);
+	ra->buf = buf;
+	ra->off = off;
+	ra->want = want;
+	ra->got = -1;
+	if (ra->threaded) {
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
 	}
-	printf("(%p)TAIL\n", &(q->tail));
-	printf("last node: (%p)%s\n", (q->tail).next, (char *)(((q->tail).next)->data));
+ }
+ 
+ /*
+  * returns how many bytes the last start_read got, 0 at end of file
+  * and -1 on an error
+  */
+ ssize_t finish_read(read_ahead* ra) {
+	ssize_t got;
+	if (!ra->threaded)
+		return read_full(ra->fd, ra->buf + ra->off, ra->want - ra->off);
+	pthread_mutex_lock(&ra->lock);
+	while (ra->got == -1)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	got = ra->got;
+	ra->buf = NULL;
+	pthread_mutex_unlock(&ra->lock);
+	return got;
+ }
+ 
+ /*
+  * reads until len bytes are in or the file ends, pipes hand over
+  * whatever they have so one read isn't enough
+  */
+ ssize_t read_full(int fd, char* buf, size_t len) {
+	size_t have = 0;
+	ssize_t got;
+	while (have < len) {
+		got = read(fd, buf + have, len - have);
+		if (got == 0)
+			break;
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return (have > 0) ? (ssize_t) have : -1;
+		}
+		have += got;
+	}
+	return have;
+ }
+ 
+ /*
+  * opens a file named on the command line, - is stdin
+  */
+ int open_input(const char* path) {
+	if (strcmp(path, "-") == 0)
+		return STDIN_FILENO;
+	return open(path, O_RDONLY);
+ }
+ 
+ /*
+  * runs consumer id, getting lines from its queue or stealing them.
+  * id is -1 for a producer that is done and only helps out by stealing
+  */
+ void consume(int id) {
+	const char* token;
+	char prefix[16];
+	size_t len, prefix_len;
+	uint64_t tokens;
+	work item;
+	scanner sc;
+	out_buf out;
+	int rank = omp_get_thread_num();
+	
+	prefix_len = snprintf(prefix, sizeof(prefix), "%d: ", rank);
+	out.data = NULL;
+	if (!ordered && !aggregate)
+		init_out(&out, OUT_BUF_SIZE);
+	/* take blocks until there is a batch or everything is done */
+	while ((id >= 0) ? take(id, &item) : steal(id, &item)) {
+		/* in ordered mode every batch gets its own buffer to wait in,
+		   out_token grows it in the rare case it isn't enough */
+		if (ordered) {
+			out.data = pool_get(ORDERED_BUF, 0);
+			out.len = 0;
+			out.cap = pool_cap(out.data);
+		}
+		/* tokenize the whole batch, newlines separate tokens too */
+		init_scanner(&sc, item.data, item.len);
+		tokens = 0;
+		if (aggregate) {
+			while ((token = next_token(&sc, &len)) != NULL) {
+				count_token(&counts[rank], hash_token(token, len), token, len, 1, 1);
+				tokens++;
+			}
+		}
+		else {
+			while ((token = next_token(&sc, &len)) != NULL) {
+				out_token(&out, prefix, prefix_len, token, len);
+				tokens++;
+			}
+		}
+		if (thread_stats != NULL)
+			count_batch(&item, tokens);
+		if (ordered)
+			submit_ordered(&item, &out);
+		if (item.owned)
+			pool_put((char*) item.data);
+	}
+	if (out.data != NULL)
+		flush_out(&out);
+	free(out.data);
+ }
+ 
+ void init_out(out_buf* out, size_t cap) {
+	out->data = malloc(cap);
+	out->len = 0;
+	out->cap = cap;
+ }
+ 
+ /*
+  * adds "prefix token\n" to out. Unordered buffers are written out
+  * when they fill up, ordered ones grow until their turn comes
+  */
+ void out_token(out_buf* out, const char* prefix, size_t prefix_len, const char* token, size_t len) {
+	size_t need = prefix_len + len + 1;
+	if (out->len + need > out->cap) {
+		if (!ordered)
+			flush_out(out);
+		if (out->len + need > out->cap && ordered) {
+			out->data = pool_grow(out->data, out->len, 2*(out->len + need));
+			out->cap = pool_cap(out->data);
+		}
+		while (out->len + need > out->cap) {
+			out->cap *= 2;
+			out->data = counted_realloc(out->data, out->cap);
+		}
+	}
+	memcpy(out->data + out->len, prefix, prefix_len);
+	memcpy(out->data + out->len + prefix_len, token, len);
+	out->data[out->len + need - 1] = '\n';
+	out->len += need;
+ }
+ 
+ /*
+  * writes everything in out to stdout in one go. The lock keeps
+  * buffers from different consumers from being cut into each other
+  */
+ void flush_out(out_buf* out) {
+	if (out->len == 0)
+		return;
+	pthread_mutex_lock(&out_lock);
+	write_all(out->data, out->len);
+	pthread_mutex_unlock(&out_lock);
+	out->len = 0;
+ }
+ 
+ void write_all(const char* data, size_t len) {
+	ssize_t n;
+	while (len > 0) {
+		n = write(STDOUT_FILENO, data, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		data += n;
+		len -= n;
+	}
+ }
+ 
+ /*
+  * hands the output of item over to the reorder stage, which takes
+  * ownership of out's buffer, and writes out whatever is now due
+  */
+ void submit_ordered(const work* item, out_buf* out) {
+	pending p, tmp;
+	int i, parent;
+	
+	p.task = item->task;
+	p.chunk = item->chunk;
+	p.out = *out;
+	pthread_mutex_lock(&order.lock);
+	if (order.num_held == order.cap) {
+		order.cap = (order.cap == 0) ? 64 : order.cap*2;
+		order.held = counted_realloc(order.held, order.cap * sizeof(pending));
+	}
+	/* sift up */
+	i = order.num_held++;
+	order.held[i] = p;
+	while (i > 0 && pending_before(&order.held[i], &order.held[parent = (i-1)/2])) {
+		tmp = order.held[i];
+		order.held[i] = order.held[parent];
+		order.held[parent] = tmp;
+		i = parent;
+	}
+	drain_ordered();
+	pthread_mutex_unlock(&order.lock);
+	out->data = NULL;
+ }
+ 
+ /*
+  * writes held output for as long as the next one due is there.
+  * A task is finished once its producer has published how many chunks
+  * it made and they have all gone out. Called with order.lock held
+  */
+ void drain_ordered() {
+	int i, child, chunks, first = atomic_load(&order.task), task = first, written = 0;
+	pending tmp;
+	while (task < num_tasks) {
+		chunks = atomic_load(&tasks[task].chunks);
+		if (chunks >= 0 && order.chunk == chunks) {
+			atomic_store(&order.task, ++task);
+			order.chunk = 0;
+			continue;
+		}
+		if (order.num_held == 0 || order.held[0].task != task
+				|| order.held[0].chunk != order.chunk)
+			break;
+		pthread_mutex_lock(&out_lock);
+		write_all(order.held[0].out.data, order.held[0].out.len);
+		pthread_mutex_unlock(&out_lock);
+		pool_put(order.held[0].out.data);
+		order.chunk++;
+		written++;
+		/* pop the top and sift down */
+		order.held[0] = order.held[--order.num_held];
+		for (i=0; (child = 2*i + 1) < order.num_held; i = child) {
+			if (child + 1 < order.num_held && pending_before(&order.held[child+1], &order.held[child]))
+				child++;
+			if (!pending_before(&order.held[child], &order.held[i]))
+				break;
+			tmp = order.held[i];
+			order.held[i] = order.held[child];
+			order.held[child] = tmp;
+		}
+	}
+	if (written > 0)
+		atomic_fetch_sub(&order.in_flight, written);
+	if (written > 0 || task != first)
+		wake(&order.room, 1);
+ }
+ 
+ int pending_before(const pending* a, const pending* b) {
+	return (a->task != b->task) ? a->task < b->task : a->chunk < b->chunk;
+ }
+ 
+ /*
+  * sets up the delimiter table and picks the fastest way to build
+  * delimiter masks. Newline is always a delimiter since batches are
+  * made of whole lines
+  */
+ void init_delims(const char* del) {
+	int i;
+	memset(delims, 0, sizeof(delims));
+	delims['\n'] = 1;
+	for (i=0; del[i] != '\0'; i++)
+		delims[(unsigned char) del[i]] = 1;
+	num_delims = 0;
+	for (i=0; i<256; i++) {
+		if (delims[i] && num_delims < MAX_SIMD_DELIMS)
+			delim_list[num_delims] = (char) i;
+		num_delims += delims[i];
+	}
+	
+	delim_mask = delim_mask_table;
+#	ifdef HAVE_X86_SIMD
+	if (num_delims <= MAX_SIMD_DELIMS) {
+		delim_mask = delim_mask_sse2;
+		if (__builtin_cpu_supports("avx2"))
+			delim_mask = delim_mask_avx2;
+	}
+#	endif
+ }
+ 
+ /*
+  * uses the named way of building delimiter masks instead of the one
+  * init_delims picked, for comparing them on a real run
+  */
+ void force_delim_mask(const char* name) {
+	if (strcmp(name, "table") == 0) {
+		delim_mask = delim_mask_table;
+		return;
+	}
+#	ifdef HAVE_X86_SIMD
+	if (num_delims <= MAX_SIMD_DELIMS) {
+		if (strcmp(name, "sse2") == 0) {
+			delim_mask = delim_mask_sse2;
+			return;
+		}
+		if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+			delim_mask = delim_mask_avx2;
+			return;
+		}
+	}
+#	endif
+	fprintf(stderr, "Tokenizer \"%s\" isn't available here\n", name);
+	exit(1);
+ }
+ 
+ /*
+  * gets sc ready to pull tokens out of len bytes starting at data
+  */
+ void init_scanner(scanner* sc, const char* data, size_t len) {
+	sc->block = data;
+	sc->end = data + len;
+	sc->carry = 1;
+	sc->token = NULL;
+	if (len > 0)
+		scan_block(sc);
+	else
+		sc->starts = sc->ends = 0;
+ }
+ 
+ /*
+  * finds the token start and end bits for the block at sc->block.
+  * The last block is copied out and padded with newlines so nothing
+  * past the end of the span is read
+  */
+ void scan_block(scanner* sc) {
+	char pad[64];
+	uint64_t d, prev;
+	size_t left = sc->end - sc->block;
+	
+	if (left >= 64)
+		d = delim_mask(sc->block);
+	else {
+		memcpy(pad, sc->block, left);
+		memset(pad + left, '\n', 64 - left);
+		d = delim_mask(pad);
+	}
+	/* prev has a bit set where the previous byte is a delimiter */
+	prev = (d << 1) | sc->carry;
+	sc->starts = ~d & prev;
+	sc->ends = d & ~prev;
+	sc->carry = d >> 63;
+ }
+ 
+ /*
+  * returns the start of the next token and stores its length in len,
+  * NULL when there are no tokens left. The buffer is never modified.
+  * Within a block starts and ends alternate, so taking the lowest bit
+  * of whichever one we are waiting for keeps them paired up
+  */
+ const char* next_token(scanner* sc, size_t* len) {
+	const char* token;
+	int bit;
+	
+	for (;;) {
+		if (sc->token == NULL && sc->starts != 0) {
+			bit = __builtin_ctzll(sc->starts);
+			sc->starts &= sc->starts - 1;
+			sc->token = sc->block + bit;
+		}
+		if (sc->token != NULL && sc->ends != 0) {
+			bit = __builtin_ctzll(sc->ends);
+			sc->ends &= sc->ends - 1;
+			token = sc->token;
+			*len = sc->block + bit - token;
+			sc->token = NULL;
+			return token;
+		}
+		/* nothing left in this block. The padding after the end of the
+		   span closes the last token, unless the span filled its last
+		   block and there was no padding */
+		sc->block += 64;
+		if (sc->block >= sc->end) {
+			if ((token = sc->token) == NULL)
+				return NULL;
+			*len = sc->end - token;
+			sc->token = NULL;
+			return token;
+		}
+		scan_block(sc);
+	}
+ }
+ 
+ /*
+  * portable version, one table lookup per byte
+  */
+ uint64_t delim_mask_table(const char* block) {
+	uint64_t mask = 0;
+	int i;
+	for (i=0; i<64; i++)
+		mask |= (uint64_t) (delims[(unsigned char) block[i]] != 0) << i;
+	return mask;
+ }
+ 
+#ifdef HAVE_X86_SIMD
+ /*
+  * compares 16 bytes at a time against each delimiter
+  */
+ uint64_t delim_mask_sse2(const char* block) {
+	uint64_t mask = 0;
+	int i, j;
+	__m128i bytes, hits;
+	for (i=0; i<4; i++) {
+		bytes = _mm_loadu_si128((const __m128i*) (block + 16*i));
+		hits = _mm_setzero_si128();
+		for (j=0; j<num_delims; j++)
+			hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(delim_list[j])));
+		mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(hits) << (16*i);
+	}
+	return mask;
+ }
+ 
+ /*
+  * same as the SSE2 version with 32 bytes at a time
+  */
+ __attribute__((target("avx2")))
+ uint64_t delim_mask_avx2(const char* block) {
+	__m256i lo = _mm256_loadu_si256((const __m256i*) block);
+	__m256i hi = _mm256_loadu_si256((const __m256i*) (block + 32));
+	__m256i hits_lo = _mm256_setzero_si256(), hits_hi = _mm256_setzero_si256();
+	__m256i d;
+	int j;
+	for (j=0; j<num_delims; j++) {
+		d = _mm256_set1_epi8(delim_list[j]);
+		hits_lo = _mm256_or_si256(hits_lo, _mm256_cmpeq_epi8(lo, d));
+		hits_hi = _mm256_or_si256(hits_hi, _mm256_cmpeq_epi8(hi, d));
+	}
+	return (uint64_t) (uint32_t) _mm256_movemask_epi8(hits_lo)
+		| ((uint64_t) (uint32_t) _mm256_movemask_epi8(hits_hi) << 32);
+ }
+#endif
+ 
+ /*
+  * times each way of tokenizing over the input files on one thread,
+  * including the old strtok_r over a writable copy. Files that aren't
+  * mapped are read into memory first, outside the timing
+  */
+ void bench_tokenizer() {
+	struct {
+		const char* name;
+		uint64_t (*mask)(const char*);
+	} kinds[3];
+	int num_kinds = 0, i, k;
+	size_t total = 0, tokens, sum, len, off;
+	char del[258], *copy, *token, *saveptr;
+	const char* t;
+	double start, elapsed;
+	scanner sc;
+	uint64_t (*chosen)(const char*) = delim_mask;
+	const char** data = malloc(num_files * sizeof(char*));
+	size_t* lens = malloc(num_files * sizeof(size_t));
+	
+	kinds[num_kinds].name = "table";
+	kinds[num_kinds++].mask = delim_mask_table;
+#	ifdef HAVE_X86_SIMD
+	if (num_delims <= MAX_SIMD_DELIMS) {
+		kinds[num_kinds].name = "sse2";
+		kinds[num_kinds++].mask = delim_mask_sse2;
+		if (__builtin_cpu_supports("avx2")) {
+			kinds[num_kinds].name = "avx2";
+			kinds[num_kinds++].mask = delim_mask_avx2;
+		}
+	}
+#	endif
+	for (i=0, k=0; i<256; i++) {
+		if (delims[i] && i != '\0')
+			del[k++] = (char) i;
+	}
+	del[k] = '\0';
+	for (i=0; i<num_files; i++) {
+		data[i] = maps[i].addr;
+		lens[i] = maps[i].len;
+		if (data[i] == NULL)
+			data[i] = read_input(file_names[i], &lens[i]);
+		total += lens[i];
+	}
+	/* a tokenizer that disagrees with the byte loop isn't worth timing */
+	for (k=0; k<num_kinds; k++) {
+		delim_mask = kinds[k].mask;
+		if (!check_scanner(kinds[k].name))
+			exit(1);
+	}
+	
+	/* strtok_r has to write into the buffer, so it gets a copy with a
+	   newline between files. The copy isn't timed */
+	copy = malloc(total + num_files + 1);
+	for (i=0, off=0; i<num_files; i++) {
+		memcpy(copy + off, data[i], lens[i]);
+		off += lens[i];
+		copy[off++] = '\n';
+	}
+	copy[off] = '\0';
+	tokens = sum = 0;
+	start = omp_get_wtime();
+	for (token = strtok_r(copy, del, &saveptr); token != NULL; token = strtok_r(NULL, del, &saveptr)) {
+		tokens++;
+		sum += strlen(token);
+	}
+	elapsed = omp_get_wtime() - start;
+	printf("strtok_r: %8.1f MB/s %zu tokens %zu bytes\n", total / elapsed / 1e6, tokens, sum);
+	free(copy);
+	
+	for (k=0; k<num_kinds; k++) {
+		delim_mask = kinds[k].mask;
+		tokens = sum = 0;
+		start = omp_get_wtime();
+		for (i=0; i<num_files; i++) {
+			init_scanner(&sc, data[i], lens[i]);
+			while ((t = next_token(&sc, &len)) != NULL) {
+				tokens++;
+				sum += len;
+			}
+		}
+		elapsed = omp_get_wtime() - start;
+		printf("%-8s: %8.1f MB/s %zu tokens %zu bytes\n", kinds[k].name, total / elapsed / 1e6, tokens, sum);
+	}
+	delim_mask = chosen;
+	for (i=0; i<num_files; i++) {
+		if (maps[i].addr == NULL)
+			free((char*) data[i]);
+	}
+	free(data);
+	free(lens);
+ }
+ 
+ /*
+  * checks the scanner against a byte at a time scan on spans around
+  * multiples of 64 bytes, ending both in and out of a token, where the
+  * last token has no padding after it to close it. Returns 0 and says
+  * what went wrong if they disagree
+  */
+ int check_scanner(const char* name) {
+	char span[4*64 + 1];
+	const char* token;
+	size_t len, len_expect, lo, pos;
+	int n, i, last;
+	scanner sc;
+	
+	for (n=1; n<=(int) sizeof(span); n++) {
+		for (last=0; last<2; last++) {
+			/* runs of 1 to 6 token bytes between newlines, which are
+			   always delimiters, and the last byte a delimiter or not */
+			for (i=0; i<n; i++)
+				span[i] = (i % 7 == 6 || i % 11 == 10) ? '\n' : 'x';
+			span[n-1] = last ? '\n' : 'x';
+			init_scanner(&sc, span, n);
+			for (pos=0;;) {
+				while (pos < (size_t) n && delims[(unsigned char) span[pos]])
+					pos++;
+				lo = pos;
+				while (pos < (size_t) n && !delims[(unsigned char) span[pos]])
+					pos++;
+				len_expect = pos - lo;
+				token = next_token(&sc, &len);
+				if (len_expect == 0 && token == NULL)
+					break;
+				if (token != span + lo || len != len_expect) {
+					fprintf(stderr, "%s tokenizer is wrong on %d bytes %s a delimiter: "
+							"token at %zu of %zu bytes\n", name, n, last ? "ending in" : "not ending in",
+							lo, len_expect);
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+ }
+ 
+ /*
+  * reads all of a file that couldn't be mapped, for -t
+  */
+ char* read_input(const char* path, size_t* len) {
+	int fd = open_input(path);
+	size_t cap = 1 << 16;
+	char* buf = malloc(cap);
+	ssize_t got;
+	
+	*len = 0;
+	if (fd == -1) {
+		perror(path);
+		exit(1);
+	}
+	while ((got = read(fd, buf + *len, cap - *len)) > 0) {
+		*len += got;
+		if (*len == cap)
+			buf = realloc(buf, cap *= 2);
+	}
+	if (got < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return buf;
+ }
+ 
+ /*
+  * multiplicative hash over 8 bytes at a time
+  */
+ uint64_t hash_token(const char* token, size_t len) {
+	uint64_t h = len * 0x9E3779B97F4A7C15ULL, w;
+	while (len >= 8) {
+		memcpy(&w, token, 8);
+		h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+		h ^= h >> 31;
+		token += 8;
+		len -= 8;
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, token, len);
+		h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+	}
+	h ^= h >> 29;
+	h *= 0x94D049BB133111EBULL;
+	return h ^ (h >> 32);
+ }
+ 
+ void init_counter(counter* c, size_t cap) {
+	c->slots = calloc(cap, sizeof(count_entry));
+	c->mask = cap - 1;
+	c->used = 0;
+	c->arena = NULL;
+ }
+ 
+ void free_counter(counter* c) {
+	arena_block* b;
+	while ((b = c->arena) != NULL) {
+		c->arena = b->next;
+		free(b);
+	}
+	free(c->slots);
+ }
+ 
+ /*
+  * adds n to the count of token. intern copies the token into c's
+  * arena the first time it is seen, merging passes strings that already
+  * live in an arena. The table doubles once it is half full
+  */
+ void count_token(counter* c, uint64_t hash, const char* token, size_t len, uint64_t n, int intern_it) {
+	count_entry* old;
+	size_t i, old_cap;
+	
+	for (i = hash & c->mask; c->slots[i].str != NULL; i = (i + 1) & c->mask) {
+		if (c->slots[i].hash == hash && c->slots[i].len == len
+				&& memcmp(c->slots[i].str, token, len) == 0) {
+			c->slots[i].count += n;
+			return;
+		}
+	}
+	c->slots[i].hash = hash;
+	c->slots[i].str = intern_it ? intern(c, token, len) : token;
+	c->slots[i].len = len;
+	c->slots[i].count = n;
+	
+	if (++c->used * 2 > c->mask + 1) {
+		old = c->slots;
+		old_cap = c->mask + 1;
+		c->slots = counted_malloc(2*old_cap * sizeof(count_entry));
+		memset(c->slots, 0, 2*old_cap * sizeof(count_entry));
+		c->mask = 2*old_cap - 1;
+		for (i=0; i<old_cap; i++) {
+			if (old[i].str != NULL) {
+				size_t j = old[i].hash & c->mask;
+				while (c->slots[j].str != NULL)
+					j = (j + 1) & c->mask;
+				c->slots[j] = old[i];
+			}
+		}
+		counted_free(old);
+	}
+ }
+ 
+ /*
+  * copies token into c's arena. Tokens bigger than a block get a block
+  * of their own
+  */
+ const char* intern(counter* c, const char* token, size_t len) {
+	arena_block* b = c->arena;
+	char* str;
+	if (b == NULL || b->used + len > ARENA_BLOCK) {
+		b = counted_malloc(sizeof(arena_block) + (len > ARENA_BLOCK ? len - ARENA_BLOCK : 0));
+		b->used = 0;
+		b->next = c->arena;
+		c->arena = b;
+	}
+	str = b->data + b->used;
+	memcpy(str, token, len);
+	b->used += len;
+	return str;
+ }
+ 
+ /*
+  * merges every thread's table. Each merging thread owns the tokens
+  * whose hash falls in its partition, so no locking is needed. Then
+  * prints either every count or the top_k most common tokens, each
+  * partition contributing its own top_k to the final pick
+  */
+ void merge_counts() {
+	int parts = thread_count, i, num_top = 0;
+	counter* merged = aligned_alloc(CACHE_LINE, parts * sizeof(counter));
+	count_entry* top = NULL;
+	char line[32];
+	out_buf out;
+	
+	if (top_k > 0)
+		top = malloc((size_t) parts * top_k * sizeof(count_entry));
+	
+#	pragma omp parallel num_threads(parts)
+	{
+		int p = omp_get_thread_num(), t, n = 0;
+		size_t j;
+		count_entry* mine = (top_k > 0) ? top + (size_t) p * top_k : NULL;
+		out_buf part_out;
+		
+		init_counter(&merged[p], 1024);
+		for (t=0; t<thread_count; t++) {
+			for (j=0; j<=counts[t].mask; j++) {
+				count_entry* e = &counts[t].slots[j];
+				if (e->str != NULL && (e->hash >> 40) % parts == (uint64_t) p)
+					count_token(&merged[p], e->hash, e->str, e->len, e->count, 0);
+			}
+		}
+		
+		if (top_k > 0) {
+			for (j=0; j<=merged[p].mask; j++) {
+				if (merged[p].slots[j].str != NULL)
+					top_push(mine, &n, &merged[p].slots[j]);
+			}
+			/* unused spots in this partition's share are left empty */
+			for (t=n; t<top_k; t++)
+				mine[t].str = NULL;
+		}
+		else {
+			init_out(&part_out, OUT_BUF_SIZE);
+			report_counts(&merged[p], &part_out);
+			flush_out(&part_out);
+			free(part_out.data);
+		}
+	}
+	
+	if (top_k > 0) {
+		/* gather the candidates and sort them, most common first */
+		for (i=0; i<parts*top_k; i++) {
+			if (top[i].str != NULL)
+				top[num_top++] = top[i];
+		}
+		qsort(top, num_top, sizeof(count_entry), compare_entries);
+		init_out(&out, OUT_BUF_SIZE);
+		for (i=0; i<num_top && i<top_k; i++)
+			out_token(&out, line, snprintf(line, sizeof(line), "%llu ",
+				(unsigned long long) top[i].count), top[i].str, top[i].len);
+		flush_out(&out);
+		free(out.data);
+		free(top);
+	}
+	
+	for (i=0; i<parts; i++)
+		free(merged[i].slots);
+	free(merged);
+ }
+ 
+ /*
+  * writes "count token" for every entry in c
+  */
+ void report_counts(counter* c, out_buf* out) {
+	char line[32];
+	size_t j;
+	for (j=0; j<=c->mask; j++) {
+		if (c->slots[j].str != NULL)
+			out_token(out, line, snprintf(line, sizeof(line), "%llu ",
+				(unsigned long long) c->slots[j].count), c->slots[j].str, c->slots[j].len);
+	}
+ }
+ 
+ /*
+  * orders entries by count, most common first, ties broken by the
+  * token so the output doesn't depend on thread timing
+  */
+ int entry_before(const count_entry* a, const count_entry* b) {
+	size_t n;
+	int cmp;
+	if (a->count != b->count)
+		return a->count > b->count;
+	n = (a->len < b->len) ? a->len : b->len;
+	cmp = memcmp(a->str, b->str, n);
+	return (cmp != 0) ? cmp < 0 : a->len < b->len;
+ }
+ 
+ /*
+  * keeps the top_k best entries in heap, a min-heap with the weakest
+  * of them on top so it is the one that gets replaced
+  */
+ void top_push(count_entry* heap, int* n, const count_entry* e) {
+	int i, child, parent;
+	count_entry tmp;
+	
+	if (*n < top_k) {
+		i = (*n)++;
+		heap[i] = *e;
+		while (i > 0 && entry_before(&heap[parent = (i-1)/2], &heap[i])) {
+			tmp = heap[i];
+			heap[i] = heap[parent];
+			heap[parent] = tmp;
+			i = parent;
+		}
+		return;
+	}
+	if (!entry_before(e, &heap[0]))
+		return;
+	heap[0] = *e;
+	for (i=0; (child = 2*i + 1) < *n; i = child) {
+		if (child + 1 < *n && entry_before(&heap[child], &heap[child+1]))
+			child++;
+		if (!entry_before(&heap[i], &heap[child]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+	}
+ }
+ 
+ int compare_entries(const void* a, const void* b) {
+	if (entry_before(a, b))
+		return -1;
+	return entry_before(b, a) ? 1 : 0;
+ }
+ 
+ /*
+  * sets up one pool per thread. Input buffers are sized for a batch,
+  * ordered output buffers for a batch plus its line prefixes. Both
+  * leave room for lines longer than tiny batches
+  */
+ void init_pools(int n) {
+	int i, j;
+	class_cap[BATCH_BUF] = (batch_size < 4096) ? 4096 : batch_size;
+	class_cap[ORDERED_BUF] = 2*batch_size + 4096;
+	pools = aligned_alloc(CACHE_LINE, n * sizeof(pool));
+	for (i=0; i<n; i++) {
+		for (j=0; j<POOL_CLASSES; j++) {
+			pools[i].free_list[j] = NULL;
+			atomic_init(&pools[i].returned[j], NULL);
+		}
+		pools[i].batch = calloc(n * POOL_CLASSES, sizeof(buf_header*));
+		pools[i].batch_tail = calloc(n * POOL_CLASSES, sizeof(buf_header*));
+		pools[i].batch_len = calloc(n * POOL_CLASSES, sizeof(int));
+		pools[i].allocs = 0;
+	}
+ }
+ 
+ /*
+  * frees every pooled buffer, wherever it ended up, and reports the
+  * allocator calls made while the pipeline ran if asked to
+  */
+ void destroy_pools() {
+	int i, j;
+	long allocs = 0;
+	buf_header *h, *next;
+	
+	for (i=0; i<thread_count; i++) {
+		for (j=0; j<POOL_CLASSES; j++) {
+			for (h = pools[i].free_list[j]; h != NULL; h = next) {
+				next = h->next;
+				free(h);
+			}
+			for (h = atomic_load(&pools[i].returned[j]); h != NULL; h = next) {
+				next = h->next;
+				free(h);
+			}
+		}
+		for (j=0; j<thread_count*POOL_CLASSES; j++) {
+			for (h = pools[i].batch[j]; h != NULL; h = next) {
+				next = h->next;
+				free(h);
+			}
+		}
+		free(pools[i].batch);
+		free(pools[i].batch_tail);
+		free(pools[i].batch_len);
+		allocs += pools[i].allocs;
+	}
+	if (verbose)
+		fprintf(stderr, "allocator calls during run: %ld\n", allocs);
+	free(pools);
+ }
+ 
+ /*
+  * returns a buffer of at least need bytes from the calling thread's
+  * pool. Takes back everything other threads have returned before
+  * going to malloc
+  */
+ char* pool_get(int cls, size_t need) {
+	int me = omp_get_thread_num();
+	pool* p = &pools[me];
+	buf_header* h;
+	
+	if (need > class_cap[cls]) {
+		h = counted_malloc(sizeof(buf_header) + need);
+		h->cap = need;
+		h->owner = -1;
+		h->cls = cls;
+		return (char*) (h + 1);
+	}
+	if (p->free_list[cls] == NULL)
+		p->free_list[cls] = atomic_exchange(&p->returned[cls], NULL);
+	if ((h = p->free_list[cls]) != NULL) {
+		p->free_list[cls] = h->next;
+		return (char*) (h + 1);
+	}
+	h = counted_malloc(sizeof(buf_header) + class_cap[cls]);
+	h->cap = class_cap[cls];
+	h->owner = me;
+	h->cls = cls;
+	return (char*) (h + 1);
+ }
+ 
+ /*
+  * gives a buffer back. Buffers from another thread's pool are
+  * collected until there are RETURN_BATCH of them, then pushed onto the
+  * owner's returned stack with a single compare and swap
+  */
+ void pool_put(char* data) {
+	int me = omp_get_thread_num(), slot;
+	pool* p = &pools[me];
+	buf_header *h = (buf_header*) data - 1, *head;
+	
+	if (h->owner < 0) {
+		counted_free(h);
+		return;
+	}
+	if (h->owner == me) {
+		h->next = p->free_list[h->cls];
+		p->free_list[h->cls] = h;
+		return;
+	}
+	slot = h->owner * POOL_CLASSES + h->cls;
+	h->next = p->batch[slot];
+	if (p->batch[slot] == NULL)
+		p->batch_tail[slot] = h;
+	p->batch[slot] = h;
+	if (++p->batch_len[slot] < RETURN_BATCH)
+		return;
+	
+	head = atomic_load_explicit(&pools[h->owner].returned[h->cls], memory_order_relaxed);
+	do {
+		p->batch_tail[slot]->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&pools[h->owner].returned[h->cls],
+			&head, p->batch[slot], memory_order_release, memory_order_relaxed));
+	p->batch[slot] = NULL;
+	p->batch_len[slot] = 0;
+ }
+ 
+ /*
+  * moves the first len bytes of data into a buffer of at least need
+  * bytes and gives the old one back
+  */
+ char* pool_grow(char* data, size_t len, size_t need) {
+	buf_header* h = (buf_header*) data - 1;
+	char* bigger = pool_get(h->cls, need);
+	memcpy(bigger, data, len);
+	pool_put(data);
+	return bigger;
+ }
+ 
+ size_t pool_cap(char* data) {
+	return ((buf_header*) data - 1)->cap;
+ }
+ 
+ /*
+  * the general purpose allocator, counted against the calling thread
+  */
+ void* counted_malloc(size_t size) {
+	pools[omp_get_thread_num()].allocs++;
+	return malloc(size);
+ }
+ 
+ void* counted_realloc(void* ptr, size_t size) {
+	pools[omp_get_thread_num()].allocs++;
+	return realloc(ptr, size);
+ }
+ 
+ void counted_free(void* ptr) {
+	pools[omp_get_thread_num()].allocs++;
+	free(ptr);
+ }
+ 
+ uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+ }
+ 
+ /*
+  * counts the time since start as spent blocked on a full queue (or
+  * the ordered window) or an empty one. start is 0 when the thread
+  * didn't have to wait or -j is off
+  */
+ void add_wait(int full, uint64_t start) {
+	stats* s;
+	if (start == 0)
+		return;
+	s = &thread_stats[omp_get_thread_num()];
+	if (full)
+		STAT_ADD(s->full_ns, now_ns() - start);
+	else
+		STAT_ADD(s->empty_ns, now_ns() - start);
+ }
+ 
+ /*
+  * every DEPTH_SAMPLE'th hand-off, adds how many items q holds to the
+  * calling thread's histogram
+  */
+ void sample_depth(queue* q) {
+	stats* s = &thread_stats[omp_get_thread_num()];
+	int depth, b;
+	if (s->handoffs++ % DEPTH_SAMPLE != 0)
+		return;
+	depth = size(q);
+	b = (depth == 0) ? 0 : 32 - __builtin_clz(depth);
+	if (b >= DEPTH_BUCKETS)
+		b = DEPTH_BUCKETS - 1;
+	STAT_ADD(s->depth[b], 1);
+ }
+ 
+ /*
+  * adds a tokenized batch to the calling thread's counters. A last line
+  * without a newline still counts as a line
+  */
+ void count_batch(const work* item, uint64_t tokens) {
+	stats* s = &thread_stats[omp_get_thread_num()];
+	const char *p = item->data, *end = item->data + item->len;
+	uint64_t n = 0;
+	
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		n++;
+		if (++p == end)
+			break;
+	}
+	if (item->len > 0 && end[-1] != '\n')
+		n++;
+	STAT_ADD(s->latency[latency_bucket(now_ns() - item->queued)], n);
+	STAT_ADD(s->lines, n);
+	STAT_ADD(s->bytes, item->len);
+	STAT_ADD(s->tokens, tokens);
+	STAT_ADD(s->batches, 1);
+ }
+ 
+ /*
+  * log-linear buckets, exact below 2^LATENCY_SUB_BITS and within 1 part
+  * in 2^LATENCY_SUB_BITS above that
+  */
+ int latency_bucket(uint64_t ns) {
+	int msb;
+	if (ns < (1 << LATENCY_SUB_BITS))
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+		+ (int) ((ns >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+ }
+ 
+ /*
+  * smallest latency that lands in bucket b
+  */
+ uint64_t bucket_floor(int b) {
+	int msb = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	if (b < (1 << LATENCY_SUB_BITS))
+		return b;
+	return (uint64_t) ((1 << LATENCY_SUB_BITS) + (b & ((1 << LATENCY_SUB_BITS) - 1)))
+		<< (msb - LATENCY_SUB_BITS);
+ }
+ 
+ /*
+  * adds up every thread's counters and the queues as they are now
+  */
+ void take_snapshot(snapshot* snap) {
+	int i, t;
+	stats* s;
+	
+	memset(snap, 0, sizeof(snapshot));
+	snap->time_ns = now_ns() - run_start;
+	for (i=0; i<thread_count; i++) {
+		s = &thread_stats[i];
+		snap->lines += atomic_load_explicit(&s->lines, memory_order_relaxed);
+		snap->bytes += atomic_load_explicit(&s->bytes, memory_order_relaxed);
+		snap->tokens += atomic_load_explicit(&s->tokens, memory_order_relaxed);
+		snap->full_ns += atomic_load_explicit(&s->full_ns, memory_order_relaxed);
+		snap->empty_ns += atomic_load_explicit(&s->empty_ns, memory_order_relaxed);
+	}
+	for (i=0; i<num_consumers; i++)
+		snap->depth += size(lines[i]);
+	for (t=0; t<num_tasks; t++)
+		snap->tasks_done += (atomic_load(&tasks[t].chunks) >= 0);
+ }
+ 
+ /*
+  * runs alongside the pipeline with -i, taking a snapshot every
+  * snapshot_ms until main tells it to stop
+  */
+ void* snapshot_thread(void* arg) {
+	struct timespec until;
+	
+	(void) arg;
+	clock_gettime(CLOCK_REALTIME, &until);
+	pthread_mutex_lock(&snapshot_lock);
+	while (!atomic_load(&stop_snapshots)) {
+		until.tv_sec += snapshot_ms / 1000;
+		until.tv_nsec += (snapshot_ms % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		while (!atomic_load(&stop_snapshots)
+				&& pthread_cond_timedwait(&snapshot_cond, &snapshot_lock, &until) != ETIMEDOUT)
+			;
+		if (atomic_load(&stop_snapshots))
+			break;
+		if (num_snapshots == snapshot_cap) {
+			snapshot_cap = (snapshot_cap == 0) ? 64 : 2*snapshot_cap;
+			snapshots = realloc(snapshots, snapshot_cap * sizeof(snapshot));
+		}
+		take_snapshot(&snapshots[num_snapshots++]);
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	return NULL;
+ }
+ 
+ /*
+  * writes the counters of every thread, their totals, the read time of
+  * each file and any snapshots to path as one JSON object. Read time of
+  * a mapped file only covers finding its line boundaries, the pages are
+  * mostly faulted in by the consumers
+  */
+ void write_stats(const char* path, uint64_t elapsed_ns) {
+	FILE* fp = fopen(path, "w");
+	snapshot total;
+	uint64_t depth[DEPTH_BUCKETS] = {0}, *file_bytes, *file_ns;
+	uint64_t latency[LATENCY_BUCKETS] = {0}, lines = 0, seen;
+	double quantiles[3] = {0.5, 0.99, 0.999};
+	const char* names[3] = {"p50_ns", "p99_ns", "p999_ns"};
+	long allocs;
+	stats* s;
+	int i, b, t, q;
+	
+	if (fp == NULL) {
+		perror(path);
+		return;
+	}
+	take_snapshot(&total);
+	fprintf(fp, "{\n  \"producers\": %d,\n  \"consumers\": %d,\n", num_producers, num_consumers);
+	fprintf(fp, "  \"batch_size\": %zu,\n  \"elapsed_ns\": %llu,\n", batch_size,
+			(unsigned long long) elapsed_ns);
+	fprintf(fp, "  \"totals\": {\"lines\": %llu, \"bytes\": %llu, \"tokens\": %llu, "
+			"\"blocked_full_ns\": %llu, \"blocked_empty_ns\": %llu},\n",
+			(unsigned long long) total.lines, (unsigned long long) total.bytes,
+			(unsigned long long) total.tokens, (unsigned long long) total.full_ns,
+			(unsigned long long) total.empty_ns);
+	
+	fprintf(fp, "  \"threads\": [\n");
+	for (i=0; i<thread_count; i++) {
+		s = &thread_stats[i];
+		allocs = pools[i].allocs;
+		fprintf(fp, "    {\"rank\": %d, \"role\": \"%s\", \"lines\": %lu, \"bytes\": %lu, "
+				"\"tokens\": %lu, \"batches\": %lu, \"blocked_full_ns\": %lu, "
+				"\"blocked_empty_ns\": %lu, \"allocator_calls\": %ld}%s\n",
+				i, (i < num_producers) ? "producer" : "consumer",
+				atomic_load(&s->lines), atomic_load(&s->bytes), atomic_load(&s->tokens),
+				atomic_load(&s->batches), atomic_load(&s->full_ns), atomic_load(&s->empty_ns),
+				allocs, (i < thread_count - 1) ? "," : "");
+		for (b=0; b<DEPTH_BUCKETS; b++)
+			depth[b] += atomic_load(&s->depth[b]);
+		for (b=0; b<LATENCY_BUCKETS; b++)
+			latency[b] += atomic_load(&s->latency[b]);
+	}
+	fprintf(fp, "  ],\n");
+	
+	/* each quantile is the top of the bucket it falls in, so it is high
+	   by at most 1 part in 2^LATENCY_SUB_BITS */
+	for (b=0; b<LATENCY_BUCKETS; b++)
+		lines += latency[b];
+	fprintf(fp, "  \"line_latency\": {\"lines\": %llu", (unsigned long long) lines);
+	for (q=0, b=0, seen=0; q<3; q++) {
+		while (b < LATENCY_BUCKETS - 1 && (seen + latency[b] < quantiles[q] * lines || latency[b] == 0)) {
+			seen += latency[b];
+			b++;
+		}
+		fprintf(fp, ", \"%s\": %llu", names[q],
+				(unsigned long long) ((lines > 0) ? bucket_floor(b + 1) - 1 : 0));
+	}
+	fprintf(fp, "},\n");
+	
+	/* bucket b holds depths in [2^(b-1), 2^b), the last one everything above */
+	fprintf(fp, "  \"queue_depth\": {\"sample_every\": %d, \"buckets\": [", DEPTH_SAMPLE);
+	for (b=0; b<DEPTH_BUCKETS; b++) {
+		fprintf(fp, "%s{\"min\": %d, \"count\": %llu}", (b > 0) ? ", " : "",
+				(b == 0) ? 0 : 1 << (b - 1), (unsigned long long) depth[b]);
+	}
+	fprintf(fp, "]},\n");
+	
+	/* a file split into ranges is read by several producers, add them up */
+	file_bytes = calloc(num_files, sizeof(uint64_t));
+	file_ns = calloc(num_files, sizeof(uint64_t));
+	for (t=0; t<num_tasks; t++) {
+		file_bytes[tasks[t].file] += tasks[t].bytes;
+		file_ns[tasks[t].file] += tasks[t].read_ns;
+	}
+	fprintf(fp, "  \"files\": [\n");
+	for (i=0; i<num_files; i++) {
+		fprintf(fp, "    {\"name\": ");
+		write_json_string(fp, file_names[i]);
+		fprintf(fp, ", \"mapped\": %s, \"bytes\": %llu, \"read_ns\": %llu}%s\n",
+				(maps[i].addr != NULL) ? "true" : "false", (unsigned long long) file_bytes[i],
+				(unsigned long long) file_ns[i], (i < num_files - 1) ? "," : "");
+	}
+	fprintf(fp, "  ],\n");
+	free(file_bytes);
+	free(file_ns);
+	
+	fprintf(fp, "  \"snapshots\": [\n");
+	for (i=0; i<num_snapshots; i++) {
+		fprintf(fp, "    {\"time_ns\": %llu, \"lines\": %llu, \"bytes\": %llu, \"tokens\": %llu, "
+				"\"blocked_full_ns\": %llu, \"blocked_empty_ns\": %llu, \"queue_depth\": %d, "
+				"\"tasks_done\": %d}%s\n",
+				(unsigned long long) snapshots[i].time_ns, (unsigned long long) snapshots[i].lines,
+				(unsigned long long) snapshots[i].bytes, (unsigned long long) snapshots[i].tokens,
+				(unsigned long long) snapshots[i].full_ns, (unsigned long long) snapshots[i].empty_ns,
+				snapshots[i].depth, snapshots[i].tasks_done, (i < num_snapshots - 1) ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+	fclose(fp);
+ }
+ 
+ void write_json_string(FILE* fp, const char* str) {
+	const unsigned char* c;
+	fputc('"', fp);
+	for (c = (const unsigned char*) str; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(fp, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(fp, "\\u%04x", *c);
+		else
+			fputc(*c, fp);
+	}
+	fputc('"', fp);
+ }
+ 
+ /*
+  * determines if all producers are done
+  *	finished is incremented once for each producer
+  */
+ int done() {
+	int i;
+	if (atomic_load(&finished) != num_producers)
+		return 0;
+	for (i=0; i<num_consumers; i++) {
+		if (size(lines[i]) != 0)
+			return 0;
+	}
+	return 1;
  }